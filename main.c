@@ -2,17 +2,87 @@
 //#define _XOPEN_SOURCE 700
 
 #include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
 #include "http.h"
 #include "cities.h"
 #include "input.h"
 #include "weather.h"
+#include "refresh.h"
+#include "endpoint.h"
+#include "hedge.h"
+#include "prefetch.h"
 
-int main()
+int main(int argc, char** argv)
 {
     http_init();
+
+    // -record FILE captures all upstream traffic; -replay FILE [-replay-timing] serves it back offline.
+    // -endpoint URL (repeatable) lists equivalent upstreams, the first one replacing the default.
+    // -keep-json stores upstream documents with the cache records; -export CITY prints one as JSON.
+    // -no-prefetch leaves refreshing to lookups instead of a background thread (always so under
+    // -record and -replay, which only see what is asked for at the prompt).
+    // -max-stale SECONDS shows entries stale for up to that long while the prefetch thread refreshes
+    // them (0, or no prefetch thread, always waits for upstream).
+    // -hedge PERCENTILE sends a duplicate of a lookup whose response is slower than that percentile
+    // of recent ones (e.g. 95), within a budget of HEDGE_DEFAULT_BUDGET hedges per request.
+    const char* replayPath = NULL;
+    const char* exportName = NULL;
+    int prefetch = 1;
+    int maxStale = REFRESH_DEFAULT_MAX_STALENESS;
+    int replayTiming = 0;
+    const char* endpoints[ENDPOINT_MAX];
+    int endpointCount = 0;
+    for (int i = 1; i < argc; i++) {
+        if (strcmp(argv[i], "-record") == 0 && i + 1 < argc) {
+            if (http_record(argv[++i]) != 0)
+                return -1;
+        } else if (strcmp(argv[i], "-replay") == 0 && i + 1 < argc) {
+            replayPath = argv[++i];
+        } else if (strcmp(argv[i], "-replay-timing") == 0) {
+            replayTiming = 1;
+        } else if (strcmp(argv[i], "-endpoint") == 0 && i + 1 < argc) {
+            if (endpointCount < ENDPOINT_MAX)
+                endpoints[endpointCount++] = argv[i + 1];
+            i++;
+        } else if (strcmp(argv[i], "-keep-json") == 0) {
+            weather_keep_json(1);
+        } else if (strcmp(argv[i], "-export") == 0 && i + 1 < argc) {
+            exportName = argv[++i];
+        } else if (strcmp(argv[i], "-no-prefetch") == 0) {
+            prefetch = 0;
+        } else if (strcmp(argv[i], "-max-stale") == 0 && i + 1 < argc) {
+            maxStale = atoi(argv[++i]);
+        } else if (strcmp(argv[i], "-hedge") == 0 && i + 1 < argc) {
+            http_set_hedging(atof(argv[++i]), HEDGE_DEFAULT_BUDGET);
+        }
+    }
+    if (exportName != NULL) {
+        json_t* exported = weather_export_json((char*)exportName);
+        if (exported == NULL) {
+            fprintf(stderr, "No cached weather for %s\n", exportName);
+            http_cleanup();
+            return -1;
+        }
+
+        json_dumpf(exported, stdout, JSON_INDENT(2) | JSON_REAL_PRECISION(10));
+        printf("\n");
+        json_decref(exported);
+        http_cleanup();
+        return 0;
+    }
+    if (endpointCount > 0)
+        http_set_endpoints(endpoints, endpointCount);
+    if (replayPath != NULL && http_replay(replayPath, replayTiming) != 0)
+        return -1;
+
+    // Every variable a cache record keeps; time and interval come with any current= variable
+    weather_register_fields();
     
     Cities* cities = NULL;
     cities_init(&cities);
+    if (prefetch)
+        prefetch_start(cities);
     
     while (1) {
         cities_print(cities);
@@ -26,25 +96,48 @@ int main()
         printf("\n");
 
         if (result == 0){
-            if (weather_exists(cityName) == 1) {
+            // One store read for the whole lookup
+            weather_entry entry;
+            weather_open(cityName, &entry);
+
+            json_t* fresh = NULL;
+            if (weather_entry_exists(&entry) == 1) {
                 printf("City not found locally. Fetching from API...\n");
-                weather_write(cityName, http_fetch(city->latitude, city->longitude));
+                refresh_city(city, &fresh);
             } else {
-                if (weather_is_stale(cityName) == 1) {
+                int staleness = weather_entry_staleness(&entry);
+                if (staleness > 0 && staleness <= maxStale && prefetch_request(city) == 0) {
+                    printf("Local data is %d seconds old. Showing it while it is refreshed in the background...\n",
+                           weather_entry_age(&entry));
+                } else if (weather_entry_is_stale(&entry) == 1) {
                     printf("Local data is stale. Fetching updated data from API...\n");
-                    weather_write(cityName, http_fetch(city->latitude, city->longitude));
+                    if (refresh_city(city, &fresh) != 0) {
+                        printf("Upstream unavailable. Showing cached data.\n");
+                    }
                 } else {
                     printf("Local data is fresh. Using cached data.\n");
                 }
             }
 
-            weather_print(cityName, 1); // Print time as an example
-            weather_print(cityName, 3); // Print temperature as an example
+            if (fresh != NULL)
+                weather_entry_replace(&entry, fresh);
+
+            weather_entry_print(&entry, 1); // Print time as an example
+            weather_entry_print(&entry, 3); // Print temperature as an example
+            weather_close(&entry);
+        } else if (result == 3) {
+            printf("Refreshing stale cities...\n");
+            int failed = refresh_stale_cities(cities, 0);
+            printf("Refresh done (%d failed, concurrency limit now %d).\n", failed, http_concurrency_limit());
         } else if (result == 1) {
             printf("Exiting program.\n");
+            prefetch_stop();
+            http_cleanup();
             return 0;
         } else {
             printf("An error occurred while selecting city.\n");
+            prefetch_stop();
+            http_cleanup();
             return -1;
         }
 
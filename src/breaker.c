@@ -0,0 +1,145 @@
+#define _POSIX_C_SOURCE 200809L
+
+#include "breaker.h"
+
+#include <stdio.h>
+#include <string.h>
+#include <time.h>
+#include <pthread.h>
+
+typedef struct {
+    char host[128];
+    Breaker_State state;
+    int failures;
+    time_t opened_at;
+    int probe_in_flight;
+    time_t probe_started_at;
+} Breaker;
+
+static Breaker breakers[BREAKER_MAX_HOSTS];
+static int breaker_count = 0;
+static pthread_mutex_t breaker_lock = PTHREAD_MUTEX_INITIALIZER;
+
+// Must be called with breaker_lock held
+static Breaker* breaker_find(const char* _Host) {
+    for(int i = 0; i < breaker_count; i++) {
+        if(strcmp(breakers[i].host, _Host) == 0)
+            return &breakers[i];
+    }
+
+    if(breaker_count == BREAKER_MAX_HOSTS)
+        return NULL;
+
+    Breaker* breaker = &breakers[breaker_count++];
+    memset(breaker, 0, sizeof(Breaker));
+    snprintf(breaker->host, sizeof(breaker->host), "%s", _Host);
+    return breaker;
+}
+
+// A probe that has not been reported within a cooldown is taken to be lost; its slot is
+// handed to the next caller rather than keeping the host half-open for good
+static int breaker_probe_busy(const Breaker* _Breaker, time_t _Now) {
+    return _Breaker->probe_in_flight && _Now - _Breaker->probe_started_at < BREAKER_COOLDOWN_SECONDS;
+}
+
+int breaker_allow(const char* _Host) {
+    int allowed = 1;
+
+    pthread_mutex_lock(&breaker_lock);
+    Breaker* breaker = breaker_find(_Host);
+    if(breaker != NULL) {
+        time_t now = time(NULL);
+        if(breaker->state == Breaker_State_Open && now - breaker->opened_at >= BREAKER_COOLDOWN_SECONDS) {
+            breaker->state = Breaker_State_HalfOpen;
+            breaker->probe_in_flight = 0;
+        }
+
+        if(breaker->state == Breaker_State_Open) {
+            allowed = 0;
+        } else if(breaker->state == Breaker_State_HalfOpen) {
+            // Only one probe at a time while we find out whether the host is back
+            allowed = !breaker_probe_busy(breaker, now);
+            if(allowed) {
+                breaker->probe_in_flight = 1;
+                breaker->probe_started_at = now;
+            }
+        }
+    }
+    pthread_mutex_unlock(&breaker_lock);
+
+    return allowed;
+}
+
+int breaker_would_allow(const char* _Host) {
+    int allowed = 1;
+
+    pthread_mutex_lock(&breaker_lock);
+    Breaker* breaker = breaker_find(_Host);
+    if(breaker != NULL) {
+        if(breaker->state == Breaker_State_Open)
+            allowed = time(NULL) - breaker->opened_at >= BREAKER_COOLDOWN_SECONDS;
+        else if(breaker->state == Breaker_State_HalfOpen)
+            allowed = !breaker_probe_busy(breaker, time(NULL));
+    }
+    pthread_mutex_unlock(&breaker_lock);
+
+    return allowed;
+}
+
+void breaker_release(const char* _Host) {
+    pthread_mutex_lock(&breaker_lock);
+    Breaker* breaker = breaker_find(_Host);
+    if(breaker != NULL)
+        breaker->probe_in_flight = 0;
+    pthread_mutex_unlock(&breaker_lock);
+}
+
+void breaker_report(const char* _Host, int _Success) {
+    pthread_mutex_lock(&breaker_lock);
+    Breaker* breaker = breaker_find(_Host);
+    if(breaker != NULL) {
+        if(_Success) {
+            breaker->state = Breaker_State_Closed;
+            breaker->failures = 0;
+        } else {
+            breaker->failures++;
+            if(breaker->state == Breaker_State_HalfOpen || breaker->failures >= BREAKER_FAILURE_THRESHOLD) {
+                if(breaker->state != Breaker_State_Open)
+                    fprintf(stderr, "Circuit opened for %s\n", breaker->host);
+                breaker->state = Breaker_State_Open;
+                breaker->opened_at = time(NULL);
+            }
+        }
+        breaker->probe_in_flight = 0;
+    }
+    pthread_mutex_unlock(&breaker_lock);
+}
+
+Breaker_State breaker_state(const char* _Host) {
+    Breaker_State state = Breaker_State_Closed;
+
+    pthread_mutex_lock(&breaker_lock);
+    Breaker* breaker = breaker_find(_Host);
+    if(breaker != NULL)
+        state = breaker->state;
+    pthread_mutex_unlock(&breaker_lock);
+
+    return state;
+}
+
+int breaker_host_from_url(const char* _Url, char* _Host, int _Size) {
+    if(_Url == NULL || _Host == NULL || _Size <= 0)
+        return -1;
+
+    const char* start = strstr(_Url, "://");
+    start = start != NULL ? start + 3 : _Url;
+
+    const char* end = strchr(start, '/');
+    int length = end != NULL ? (int)(end - _Url) : (int)strlen(_Url);
+    if(length >= _Size)
+        length = _Size - 1;
+
+    memcpy(_Host, _Url, length);
+    _Host[length] = '\0';
+    return 0;
+}
@@ -0,0 +1,35 @@
+#ifndef Breaker_h__
+#define Breaker_h__
+
+/*
+ * Per-host circuit breaker. After BREAKER_FAILURE_THRESHOLD failures in a row the host is
+ * considered down and requests fail fast for BREAKER_COOLDOWN_SECONDS. After that a single
+ * probe request is let through; its outcome closes the breaker again or restarts the cooldown.
+ * A probe that is neither reported nor released within BREAKER_COOLDOWN_SECONDS is given up
+ * on, and the next request becomes the probe.
+ */
+
+#define BREAKER_FAILURE_THRESHOLD 5
+#define BREAKER_COOLDOWN_SECONDS 30
+#define BREAKER_MAX_HOSTS 16
+
+typedef enum {
+    Breaker_State_Closed = 0,
+    Breaker_State_Open = 1,
+    Breaker_State_HalfOpen = 2
+} Breaker_State;
+
+// Returns 1 if a request to _Host may be sent, 0 if it should fail fast
+int breaker_allow(const char* _Host);
+// The same answer without taking the half-open probe, for callers that still have to queue
+int breaker_would_allow(const char* _Host);
+void breaker_report(const char* _Host, int _Success);
+// For a caller that was allowed but gave up before sending: frees the half-open probe, if it
+// had it, without counting an outcome
+void breaker_release(const char* _Host);
+Breaker_State breaker_state(const char* _Host);
+
+// Copies the scheme://host[:port] part of _Url into _Host
+int breaker_host_from_url(const char* _Url, char* _Host, int _Size);
+
+#endif // Breaker_h__
@@ -0,0 +1,198 @@
+#include "buffer.h"
+
+#include <stdlib.h>
+#include <string.h>
+#include <pthread.h>
+
+#define BUFFER_CLASSES (BUFFER_MAX_SHIFT - BUFFER_MIN_SHIFT + 1)
+#define BUFFER_ENDPOINTS 16
+
+// Sits in front of every buffer; the caller only ever sees the bytes after it
+typedef struct BufferHeader {
+    struct BufferHeader* next; // free list link while idle
+    size_t capacity;
+    int size_class; // -1 for buffers too large to pool
+} BufferHeader;
+
+typedef struct {
+    unsigned long hash;
+    size_t size;
+} BufferEndpoint;
+
+static BufferHeader* idle[BUFFER_CLASSES];
+static int idle_count[BUFFER_CLASSES];
+
+static BufferEndpoint endpoints[BUFFER_ENDPOINTS];
+static int endpoint_next = 0;
+
+static pthread_mutex_t buffer_lock = PTHREAD_MUTEX_INITIALIZER;
+
+static BufferHeader* buffer_header(const char* _Data) {
+    return (BufferHeader*)(_Data - sizeof(BufferHeader));
+}
+
+static int buffer_class(size_t _Capacity) {
+    for(int i = 0; i < BUFFER_CLASSES; i++) {
+        if(((size_t)1 << (BUFFER_MIN_SHIFT + i)) >= _Capacity)
+            return i;
+    }
+    return -1;
+}
+
+char* buffer_acquire(size_t _Capacity) {
+    int size_class = buffer_class(_Capacity);
+    BufferHeader* header = NULL;
+
+    if(size_class >= 0) {
+        pthread_mutex_lock(&buffer_lock);
+        header = idle[size_class];
+        if(header != NULL) {
+            idle[size_class] = header->next;
+            idle_count[size_class]--;
+        }
+        pthread_mutex_unlock(&buffer_lock);
+    }
+
+    if(header == NULL) {
+        size_t capacity = size_class >= 0 ? (size_t)1 << (BUFFER_MIN_SHIFT + size_class) : _Capacity;
+        header = (BufferHeader*)malloc(sizeof(BufferHeader) + capacity);
+        if(header == NULL)
+            return NULL;
+        header->capacity = capacity;
+        header->size_class = size_class;
+    }
+
+    header->next = NULL;
+    char* data = (char*)(header + 1);
+    data[0] = '\0';
+    return data;
+}
+
+char* buffer_grow(char* _Data, size_t _Used, size_t _Needed) {
+    if(_Data != NULL && buffer_capacity(_Data) >= _Needed)
+        return _Data;
+
+    // At least double, so a response of unknown length costs a logarithmic number of moves
+    size_t capacity = _Data != NULL ? buffer_capacity(_Data) * 2 : 0;
+    char* grown = buffer_acquire(capacity > _Needed ? capacity : _Needed);
+    if(grown == NULL)
+        return NULL;
+
+    if(_Data != NULL) {
+        memcpy(grown, _Data, _Used);
+        buffer_release(_Data);
+    }
+    return grown;
+}
+
+int buffer_append(char** _Data, size_t* _Size, const void* _Contents, size_t _Length) {
+    char* data = buffer_grow(*(_Data), *(_Size), *(_Size) + _Length + 1);
+    if(data == NULL)
+        return -1;
+
+    memcpy(data + *(_Size), _Contents, _Length);
+    *(_Size) += _Length;
+    data[*(_Size)] = '\0';
+    *(_Data) = data;
+    return 0;
+}
+
+char* buffer_copy(const char* _Contents, size_t _Length) {
+    char* data = buffer_acquire(_Length + 1);
+    if(data == NULL)
+        return NULL;
+
+    memcpy(data, _Contents, _Length);
+    data[_Length] = '\0';
+    return data;
+}
+
+size_t buffer_capacity(const char* _Data) {
+    return _Data != NULL ? buffer_header(_Data)->capacity : 0;
+}
+
+void buffer_release(char* _Data) {
+    if(_Data == NULL)
+        return;
+
+    BufferHeader* header = buffer_header(_Data);
+    int size_class = header->size_class;
+
+    if(size_class >= 0) {
+        pthread_mutex_lock(&buffer_lock);
+        if(idle_count[size_class] < BUFFER_POOL_DEPTH) {
+            header->next = idle[size_class];
+            idle[size_class] = header;
+            idle_count[size_class]++;
+            header = NULL;
+        }
+        pthread_mutex_unlock(&buffer_lock);
+    }
+
+    free(header);
+}
+
+// FNV-1a over everything before the query string
+static unsigned long buffer_endpoint_hash(const char* _Url) {
+    unsigned long hash = 2166136261UL;
+    for(const char* c = _Url; *c != '\0' && *c != '?'; c++) {
+        hash ^= (unsigned char)*c;
+        hash *= 16777619UL;
+    }
+    return hash;
+}
+
+size_t buffer_size_hint(const char* _Url) {
+    size_t hint = 0;
+    if(_Url == NULL)
+        return hint;
+
+    unsigned long hash = buffer_endpoint_hash(_Url);
+    pthread_mutex_lock(&buffer_lock);
+    for(int i = 0; i < BUFFER_ENDPOINTS; i++) {
+        if(endpoints[i].hash == hash && endpoints[i].size > 0) {
+            hint = endpoints[i].size;
+            break;
+        }
+    }
+    pthread_mutex_unlock(&buffer_lock);
+
+    return hint;
+}
+
+void buffer_record_size(const char* _Url, size_t _Size) {
+    if(_Url == NULL)
+        return;
+
+    unsigned long hash = buffer_endpoint_hash(_Url);
+    pthread_mutex_lock(&buffer_lock);
+    BufferEndpoint* endpoint = NULL;
+    for(int i = 0; i < BUFFER_ENDPOINTS && endpoint == NULL; i++) {
+        if(endpoints[i].hash == hash)
+            endpoint = &endpoints[i];
+    }
+    if(endpoint == NULL) {
+        endpoint = &endpoints[endpoint_next];
+        endpoint_next = (endpoint_next + 1) % BUFFER_ENDPOINTS;
+        endpoint->hash = hash;
+        endpoint->size = 0;
+    }
+
+    // Follows growth at once and shrinks slowly, so one small response does not undersize the next
+    size_t decayed = endpoint->size - endpoint->size / 8;
+    endpoint->size = _Size + 1 > decayed ? _Size + 1 : decayed;
+    pthread_mutex_unlock(&buffer_lock);
+}
+
+void buffer_trim() {
+    pthread_mutex_lock(&buffer_lock);
+    for(int i = 0; i < BUFFER_CLASSES; i++) {
+        while(idle[i] != NULL) {
+            BufferHeader* header = idle[i];
+            idle[i] = header->next;
+            free(header);
+        }
+        idle_count[i] = 0;
+    }
+    pthread_mutex_unlock(&buffer_lock);
+}
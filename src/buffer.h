@@ -0,0 +1,37 @@
+#ifndef Buffer_h__
+#define Buffer_h__
+
+#include <stddef.h>
+
+/*
+ * Pool of response buffers in power-of-two size classes. Released buffers are kept per class
+ * and handed out again, so steady-state fetches of similar responses never reach the allocator.
+ * Buffers above the largest class are plain allocations.
+ */
+
+#define BUFFER_MIN_SHIFT 12 // 4 KiB
+#define BUFFER_MAX_SHIFT 20 // 1 MiB
+#define BUFFER_POOL_DEPTH 16 // idle buffers kept per class
+
+// A buffer of at least _Capacity bytes, or NULL if out of memory
+char* buffer_acquire(size_t _Capacity);
+
+// Makes room for _Needed bytes, keeping the first _Used. Returns the (possibly moved) buffer,
+// or NULL with _Data untouched. _Data may be NULL.
+char* buffer_grow(char* _Data, size_t _Used, size_t _Needed);
+
+// Appends and keeps the contents NUL-terminated, growing as needed; returns 0 or -1
+int buffer_append(char** _Data, size_t* _Size, const void* _Contents, size_t _Length);
+
+char* buffer_copy(const char* _Contents, size_t _Length);
+size_t buffer_capacity(const char* _Data);
+void buffer_release(char* _Data);
+
+// Response size history per endpoint (scheme, host and path), used to size the first buffer
+size_t buffer_size_hint(const char* _Url);
+void buffer_record_size(const char* _Url, size_t _Size);
+
+// Frees every idle buffer
+void buffer_trim();
+
+#endif // Buffer_h__
@@ -0,0 +1,229 @@
+#define _POSIX_C_SOURCE 200809L
+
+#include "capture.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <pthread.h>
+
+#include "jansson/jansson.h"
+
+static Capture_Mode mode = Capture_Mode_Off;
+static int timing = 0;
+static FILE* archive = NULL;
+
+static CaptureEntry* entries = NULL;
+static int entry_count = 0;
+
+static pthread_mutex_t capture_lock = PTHREAD_MUTEX_INITIALIZER;
+
+static char* capture_strdup(const char* _Value, size_t _Length) {
+    char* copy = (char*)malloc(_Length + 1);
+    if(copy == NULL)
+        return NULL;
+    memcpy(copy, _Value, _Length);
+    copy[_Length] = '\0';
+    return copy;
+}
+
+// _Path and _LineNumber (1-based, in the archive) only locate errors; every line is parsed on its
+// own, so jansson's own line number is always 1
+static int capture_load_line(const char* _Line, const char* _Path, int _LineNumber) {
+    json_error_t error;
+    json_t* root = json_loads(_Line, 0, &error);
+    if(root == NULL) {
+        fprintf(stderr, "%s:%d: invalid capture line (column %d): %s\n", _Path, _LineNumber, error.column, error.text);
+        return -1;
+    }
+
+    json_t* url = json_object_get(root, "url");
+    json_t* headers = json_object_get(root, "headers");
+    json_t* body = json_object_get(root, "body");
+    if(!json_is_string(url)) {
+        fprintf(stderr, "%s:%d: capture line has no url\n", _Path, _LineNumber);
+        json_decref(root);
+        return -1;
+    }
+
+    CaptureEntry* grown = (CaptureEntry*)realloc(entries, sizeof(CaptureEntry) * (entry_count + 1));
+    if(grown == NULL) {
+        json_decref(root);
+        return -2;
+    }
+    entries = grown;
+
+    CaptureEntry* entry = &entries[entry_count];
+    memset(entry, 0, sizeof(CaptureEntry));
+    entry->url = capture_strdup(json_string_value(url), json_string_length(url));
+    entry->result = (int)json_integer_value(json_object_get(root, "result"));
+    entry->status = (long)json_integer_value(json_object_get(root, "status"));
+    entry->elapsed_ms = json_number_value(json_object_get(root, "elapsed_ms"));
+    entry->headers = capture_strdup(json_is_string(headers) ? json_string_value(headers) : "", json_is_string(headers) ? json_string_length(headers) : 0);
+    if(json_is_string(body)) {
+        entry->body_size = json_string_length(body);
+        entry->body = capture_strdup(json_string_value(body), entry->body_size);
+    }
+    entry_count++;
+
+    json_decref(root);
+    return 0;
+}
+
+static int capture_load(const char* _Path) {
+    FILE* file = fopen(_Path, "r");
+    if(file == NULL) {
+        perror(_Path);
+        return -1;
+    }
+
+    char* line = NULL;
+    size_t capacity = 0;
+    ssize_t length;
+    int loaded = 0;
+    int line_number = 0;
+    while((length = getline(&line, &capacity, file)) != -1) {
+        line_number++;
+        if(length > 1 && capture_load_line(line, _Path, line_number) == 0)
+            loaded++;
+    }
+
+    free(line);
+    fclose(file);
+    return loaded;
+}
+
+int capture_open(Capture_Mode _Mode, const char* _Path, int _Timing) {
+    capture_close();
+
+    if(_Mode == Capture_Mode_Off)
+        return 0;
+    if(_Path == NULL)
+        return -1;
+
+    pthread_mutex_lock(&capture_lock);
+    int result = 0;
+    if(_Mode == Capture_Mode_Record) {
+        archive = fopen(_Path, "a");
+        if(archive == NULL) {
+            perror(_Path);
+            result = -1;
+        }
+    } else {
+        result = capture_load(_Path);
+        if(result >= 0)
+            printf("Replaying %d recorded responses from %s\n", result, _Path);
+    }
+
+    if(result >= 0) {
+        mode = _Mode;
+        timing = _Timing;
+    }
+    pthread_mutex_unlock(&capture_lock);
+
+    return result < 0 ? result : 0;
+}
+
+Capture_Mode capture_mode() {
+    return mode;
+}
+
+int capture_timing() {
+    return timing;
+}
+
+int capture_record(const char* _Url, int _Result, long _Status, double _ElapsedMs, const char* _Headers, const char* _Body, size_t _BodySize) {
+    if(mode != Capture_Mode_Record || _Url == NULL)
+        return -1;
+
+    json_t* root = json_object();
+    json_object_set_new(root, "url", json_string(_Url));
+    json_object_set_new(root, "result", json_integer(_Result));
+    json_object_set_new(root, "status", json_integer(_Status));
+    json_object_set_new(root, "elapsed_ms", json_real(_ElapsedMs));
+    json_object_set_new(root, "headers", json_string(_Headers != NULL ? _Headers : ""));
+    // Bodies are stored as JSON strings, which must be UTF-8; the forecast API only sends JSON
+    if(_Body != NULL)
+        json_object_set_new(root, "body", json_stringn(_Body, _BodySize));
+
+    char* line = json_dumps(root, JSON_COMPACT);
+    json_decref(root);
+    if(line == NULL)
+        return -1;
+
+    pthread_mutex_lock(&capture_lock);
+    int result = -1;
+    if(archive != NULL) {
+        fprintf(archive, "%s\n", line);
+        fflush(archive);
+        result = 0;
+    }
+    pthread_mutex_unlock(&capture_lock);
+
+    free(line);
+    return result;
+}
+
+const CaptureEntry* capture_find(const char* _Url) {
+    if(_Url == NULL)
+        return NULL;
+
+    CaptureEntry* last = NULL;
+
+    pthread_mutex_lock(&capture_lock);
+    for(int i = 0; i < entry_count; i++) {
+        if(strcmp(entries[i].url, _Url) != 0)
+            continue;
+
+        last = &entries[i];
+        if(!entries[i].used) {
+            entries[i].used = 1;
+            break;
+        }
+    }
+    pthread_mutex_unlock(&capture_lock);
+
+    return last;
+}
+
+size_t capture_append(void* _Contents, size_t _Size, size_t _Nmemb, void* _UserPtr) {
+    size_t realsize = _Size * _Nmemb;
+    CaptureBuffer* buffer = (CaptureBuffer*)_UserPtr;
+
+    char* ptr = realloc(buffer->data, buffer->size + realsize + 1);
+    if(ptr == NULL)
+        return 0;
+
+    buffer->data = ptr;
+    memcpy(&(buffer->data[buffer->size]), _Contents, realsize);
+    buffer->size += realsize;
+    buffer->data[buffer->size] = 0;
+    return realsize;
+}
+
+void capture_buffer_free(CaptureBuffer* _Buffer) {
+    free(_Buffer->data);
+    _Buffer->data = NULL;
+    _Buffer->size = 0;
+}
+
+void capture_close() {
+    pthread_mutex_lock(&capture_lock);
+    if(archive != NULL) {
+        fclose(archive);
+        archive = NULL;
+    }
+
+    for(int i = 0; i < entry_count; i++) {
+        free(entries[i].url);
+        free(entries[i].headers);
+        free(entries[i].body);
+    }
+    free(entries);
+    entries = NULL;
+    entry_count = 0;
+
+    mode = Capture_Mode_Off;
+    timing = 0;
+    pthread_mutex_unlock(&capture_lock);
+}
@@ -0,0 +1,53 @@
+#ifndef Capture_h__
+#define Capture_h__
+
+#include <stddef.h>
+
+/*
+ * Capture archive for upstream traffic. In record mode every completed attempt is appended
+ * as one JSON object per line: url, curl result, HTTP status, raw response headers, body
+ * and elapsed time. In replay mode the archive is loaded up front and fetches are answered
+ * from it without touching the network, optionally after the originally recorded delay.
+ */
+
+typedef enum {
+    Capture_Mode_Off,
+    Capture_Mode_Record,
+    Capture_Mode_Replay
+} Capture_Mode;
+
+typedef struct {
+    char* url;
+    int result; // CURLcode of the attempt
+    long status;
+    double elapsed_ms;
+    char* headers;
+    char* body;
+    size_t body_size;
+    int used;
+} CaptureEntry;
+
+// Growable byte buffer for collecting headers and bodies while recording
+typedef struct {
+    char* data;
+    size_t size;
+} CaptureBuffer;
+
+// Opens _Path for appending (record) or loads it (replay). _Timing only matters for replay.
+int capture_open(Capture_Mode _Mode, const char* _Path, int _Timing);
+Capture_Mode capture_mode();
+int capture_timing();
+
+int capture_record(const char* _Url, int _Result, long _Status, double _ElapsedMs, const char* _Headers, const char* _Body, size_t _BodySize);
+
+// The next unreplayed response recorded for _Url; once all have been served, the last one
+// again. NULL if the URL was never recorded. Entries live until capture_close.
+const CaptureEntry* capture_find(const char* _Url);
+
+// curl header/write callback appending to a CaptureBuffer
+size_t capture_append(void* _Contents, size_t _Size, size_t _Nmemb, void* _UserPtr);
+void capture_buffer_free(CaptureBuffer* _Buffer);
+
+void capture_close();
+
+#endif // Capture_h__
@@ -1,3 +1,6 @@
+#ifndef Cities_h__
+#define Cities_h__
+
 #include "linkedlist.h"
 #include "city.h"
 
@@ -18,4 +21,6 @@ void cities_destroy(Cities* _Cities, City** _CityPtr);
 
 void cities_print(Cities* _Cities);
 
-void cities_dispose(Cities** _CitiesPtr);
\ No newline at end of file
+void cities_dispose(Cities** _CitiesPtr);
+
+#endif // Cities_h__
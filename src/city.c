@@ -5,6 +5,7 @@
 #include <stdio.h>
 
 #include "utils.h"
+#include "request.h"
 
 int city_init(const char* _Name, const char* _Latitude, const char* _Longitude, City** _CityPtr) {
     if(_Name == NULL || _CityPtr == NULL)
@@ -42,6 +43,35 @@ int city_init(const char* _Name, const char* _Latitude, const char* _Longitude,
 	return 0;
 }
 
+const char* city_get_url(City* _City) {
+	if(_City == NULL)
+		return NULL;
+
+	if(_City->url != NULL && _City->url_generation == request_generation())
+		return _City->url;
+
+	char latitude[32];
+	char longitude[32];
+	snprintf(latitude, sizeof(latitude), "%.4f", _City->latitude);
+	snprintf(longitude, sizeof(longitude), "%.4f", _City->longitude);
+
+	char buffer[2048];
+	int length = request_build_url(buffer, sizeof(buffer), latitude, longitude);
+	if(length < 0)
+		return NULL;
+
+	char* url = strdup(buffer);
+	if(url == NULL)
+		return NULL;
+
+	if(_City->url != NULL)
+		free(_City->url);
+
+	_City->url = url;
+	_City->url_generation = request_generation();
+	return _City->url;
+}
+
 void city_dispose(City** _CityPtr) {
     if(_CityPtr == NULL || *(_CityPtr) == NULL)
 		return;
@@ -51,6 +81,9 @@ void city_dispose(City** _CityPtr) {
 	if(_City->name != NULL)
 		free(_City->name);
 
+	if(_City->url != NULL)
+		free(_City->url);
+
 	free(_City);
 	*(_CityPtr) = NULL;
-}
\ No newline at end of file
+}
\ No newline at end of file
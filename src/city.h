@@ -1,10 +1,18 @@
+#ifndef City_h__
+#define City_h__
+
 typedef struct City City;
 
 typedef struct City {
     char* name;
     float latitude;
     float longitude;
+    char* url; // forecast URL, rebuilt only when the registered request variables change
+    unsigned int url_generation;
 } City;
 
 int city_init(const char* _Name, const char* _Latitude, const char* _Longitude, City** _CityPtr);
-void city_dispose(City** _CityPtr);
\ No newline at end of file
+const char* city_get_url(City* _City);
+void city_dispose(City** _CityPtr);
+
+#endif // City_h__
@@ -0,0 +1,200 @@
+#define _POSIX_C_SOURCE 200809L
+
+#include "endpoint.h"
+
+#include <stdio.h>
+#include <string.h>
+#include <time.h>
+#include <pthread.h>
+
+#include "breaker.h"
+#include "request.h"
+
+typedef struct {
+    EndpointStats stats;
+    char host[128];
+    double picked_at; // monotonic ms, 0 if never
+} Endpoint;
+
+static Endpoint endpoints[ENDPOINT_MAX];
+static int endpoint_total = 0;
+static pthread_mutex_t endpoint_lock = PTHREAD_MUTEX_INITIALIZER;
+
+static double endpoint_now_ms() {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1000.0 + ts.tv_nsec / 1000000.0;
+}
+
+int endpoint_configure(const char** _BaseUrls, int _Count) {
+    if(_BaseUrls == NULL || _Count < 1)
+        return -1;
+    if(_Count > ENDPOINT_MAX)
+        _Count = ENDPOINT_MAX;
+
+    pthread_mutex_lock(&endpoint_lock);
+    memset(endpoints, 0, sizeof(endpoints));
+    endpoint_total = 0;
+    for(int i = 0; i < _Count; i++) {
+        if(_BaseUrls[i] == NULL)
+            continue;
+
+        Endpoint* endpoint = &endpoints[endpoint_total++];
+        snprintf(endpoint->stats.base_url, sizeof(endpoint->stats.base_url), "%s", _BaseUrls[i]);
+        // A trailing slash would end up doubled in front of the path
+        size_t length = strlen(endpoint->stats.base_url);
+        if(length > 0 && endpoint->stats.base_url[length - 1] == '/')
+            endpoint->stats.base_url[length - 1] = '\0';
+        endpoint->stats.healthy = 1;
+        breaker_host_from_url(endpoint->stats.base_url, endpoint->host, sizeof(endpoint->host));
+    }
+    pthread_mutex_unlock(&endpoint_lock);
+
+    if(endpoint_total > 0)
+        request_set_base_url(endpoints[0].stats.base_url);
+    return 0;
+}
+
+// Length of the base _Url starts with, or 0 if it is not under that base
+static size_t endpoint_prefix(const char* _Url, const char* _BaseUrl) {
+    size_t length = strlen(_BaseUrl);
+    if(strncmp(_Url, _BaseUrl, length) != 0)
+        return 0;
+
+    char next = _Url[length];
+    return next == '\0' || next == '/' || next == '?' ? length : 0;
+}
+
+// Must be called with endpoint_lock held. Unmeasured endpoints, and ones not picked for a
+// while, sort first; the rest by their moving average.
+static double endpoint_rank(Endpoint* _Endpoint, double _Now) {
+    if(_Endpoint->stats.rtt_ms <= 0 || _Now - _Endpoint->picked_at >= ENDPOINT_EXPLORE_MS)
+        return 0;
+    return _Endpoint->stats.rtt_ms;
+}
+
+int endpoint_acquire(const char* _Url, char* _Buffer, size_t _Size) {
+    if(_Url == NULL || _Buffer == NULL)
+        return -1;
+
+    pthread_mutex_lock(&endpoint_lock);
+    size_t prefix = endpoint_total > 0 ? endpoint_prefix(_Url, endpoints[0].stats.base_url) : 0;
+    if(prefix == 0) {
+        pthread_mutex_unlock(&endpoint_lock);
+
+        // Checked before the breaker, which may hand out its half-open probe
+        if(snprintf(_Buffer, _Size, "%s", _Url) >= (int)_Size)
+            return -2;
+
+        char host[128];
+        breaker_host_from_url(_Url, host, sizeof(host));
+        return breaker_allow(host) ? 0 : -1;
+    }
+
+    // Candidates best first; the breaker is only asked about the ones actually tried, since
+    // letting a half-open endpoint through takes its single probe slot
+    int order[ENDPOINT_MAX];
+    double now = endpoint_now_ms();
+    for(int i = 0; i < endpoint_total; i++) {
+        int j = i;
+        double rank = endpoint_rank(&endpoints[i], now);
+        while(j > 0 && endpoint_rank(&endpoints[order[j - 1]], now) > rank) {
+            order[j] = order[j - 1];
+            j--;
+        }
+        order[j] = i;
+    }
+
+    // The target is built first: an endpoint whose URL does not fit is skipped without
+    // asking its breaker, so no probe is taken for an attempt that cannot be made
+    Endpoint* picked = NULL;
+    int too_long = 0;
+    for(int i = 0; i < endpoint_total && picked == NULL; i++) {
+        Endpoint* endpoint = &endpoints[order[i]];
+        if(snprintf(_Buffer, _Size, "%s%s", endpoint->stats.base_url, _Url + prefix) >= (int)_Size)
+            too_long = 1;
+        else if(breaker_allow(endpoint->host))
+            picked = endpoint;
+    }
+    if(picked != NULL)
+        picked->picked_at = now;
+    pthread_mutex_unlock(&endpoint_lock);
+
+    return picked != NULL ? 0 : (too_long ? -2 : -1);
+}
+
+int endpoint_available(const char* _Url) {
+    if(_Url == NULL)
+        return 0;
+
+    pthread_mutex_lock(&endpoint_lock);
+    int available = 0;
+    if(endpoint_total > 0 && endpoint_prefix(_Url, endpoints[0].stats.base_url) != 0) {
+        for(int i = 0; i < endpoint_total && !available; i++)
+            available = breaker_would_allow(endpoints[i].host);
+        pthread_mutex_unlock(&endpoint_lock);
+        return available;
+    }
+    pthread_mutex_unlock(&endpoint_lock);
+
+    char host[128];
+    breaker_host_from_url(_Url, host, sizeof(host));
+    return breaker_would_allow(host);
+}
+
+void endpoint_release(const char* _Url) {
+    if(_Url == NULL)
+        return;
+
+    char host[128];
+    breaker_host_from_url(_Url, host, sizeof(host));
+    breaker_release(host);
+}
+
+void endpoint_report(const char* _Url, double _RttMs, int _Healthy) {
+    if(_Url == NULL)
+        return;
+
+    char host[128];
+    breaker_host_from_url(_Url, host, sizeof(host));
+    breaker_report(host, _Healthy);
+
+    pthread_mutex_lock(&endpoint_lock);
+    for(int i = 0; i < endpoint_total; i++) {
+        EndpointStats* stats = &endpoints[i].stats;
+        if(endpoint_prefix(_Url, stats->base_url) == 0)
+            continue;
+
+        double sample = _Healthy ? _RttMs : ENDPOINT_FAILURE_MS;
+        if(stats->rtt_ms <= 0)
+            stats->rtt_ms = sample;
+        else
+            stats->rtt_ms += (sample - stats->rtt_ms) * ENDPOINT_WEIGHT;
+
+        stats->healthy = _Healthy;
+        stats->attempts++;
+        if(!_Healthy)
+            stats->failures++;
+        break;
+    }
+    pthread_mutex_unlock(&endpoint_lock);
+}
+
+int endpoint_count() {
+    return endpoint_total;
+}
+
+int endpoint_stats(int _Index, EndpointStats* _Stats) {
+    if(_Stats == NULL)
+        return -1;
+
+    pthread_mutex_lock(&endpoint_lock);
+    int result = -1;
+    if(_Index >= 0 && _Index < endpoint_total) {
+        *(_Stats) = endpoints[_Index].stats;
+        result = 0;
+    }
+    pthread_mutex_unlock(&endpoint_lock);
+
+    return result;
+}
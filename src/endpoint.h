@@ -0,0 +1,51 @@
+#ifndef Endpoint_h__
+#define Endpoint_h__
+
+#include <stddef.h>
+
+/*
+ * Equivalent upstream endpoints (the public API, mirrors, a self-hosted Open-Meteo, a local
+ * stand-in). URLs are always built against the first one, so cache keys and capture archives
+ * do not depend on where a request was served from. Each attempt is then rewritten onto the
+ * endpoint with the lowest moving average of recent round trips whose circuit breaker lets
+ * it through. A failure counts as a very slow round trip, so traffic moves away from a
+ * failing endpoint before its circuit opens. An endpoint that has not been picked for
+ * ENDPOINT_EXPLORE_MS gets the next attempt, so a recovered or faster one is noticed.
+ */
+
+#define ENDPOINT_MAX 8
+#define ENDPOINT_WEIGHT 0.3 // weight of a new round trip in the moving average
+#define ENDPOINT_FAILURE_MS 2000.0 // what a failed attempt counts as
+#define ENDPOINT_EXPLORE_MS 10000
+
+typedef struct {
+    char base_url[256];
+    double rtt_ms; // moving average, 0 until measured
+    int healthy; // outcome of the last attempt
+    unsigned long attempts;
+    unsigned long failures;
+} EndpointStats;
+
+// Replaces the endpoint list; the first entry is the one URLs are built against
+int endpoint_configure(const char** _BaseUrls, int _Count);
+
+// Writes _Url, rewritten onto the endpoint picked for this attempt, to _Buffer. URLs that are
+// not under the first endpoint are used as they are. Returns 0, -1 if no endpoint's circuit
+// lets the attempt through, or -2 if the rewritten URL does not fit. Fit is checked first, so a
+// URL that cannot be used never takes a half-open probe.
+int endpoint_acquire(const char* _Url, char* _Buffer, size_t _Size);
+
+// 1 if endpoint_acquire would find an endpoint for _Url right now, without picking one or
+// taking a half-open probe; lets queued callers fail fast before spending a token
+int endpoint_available(const char* _Url);
+
+// Outcome of an attempt on a URL returned by endpoint_acquire; also feeds the circuit breaker
+void endpoint_report(const char* _Url, double _RttMs, int _Healthy);
+// For an attempt on a URL returned by endpoint_acquire that was never sent (no handle, no
+// buffer): frees the endpoint's half-open probe without counting an outcome
+void endpoint_release(const char* _Url);
+
+int endpoint_count();
+int endpoint_stats(int _Index, EndpointStats* _Stats);
+
+#endif // Endpoint_h__
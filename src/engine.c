@@ -0,0 +1,493 @@
+#define _POSIX_C_SOURCE 200809L
+
+#include "engine.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <errno.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/epoll.h>
+#include <sys/timerfd.h>
+
+#include "http.h"
+#include "endpoint.h"
+#include "scheduler.h"
+#include "capture.h"
+#include "buffer.h"
+
+#define ENGINE_MAX_EVENTS 64
+
+typedef struct EngineTransfer {
+    struct EngineTransfer* next; // in the queue, or in the started list
+    struct EngineTransfer* previous; // only used in the started list
+    CURL* handle;
+    char* url;
+    char* data;
+    size_t size;
+    int attempts;
+    double ready_at; // retries wait out their backoff in the queue
+    double started_at;
+    CaptureBuffer headers; // only collected while recording
+    const CaptureEntry* replay; // recorded response waiting out its original timing
+    Scheduler_Class priority; // of the thread that submitted it
+    FetchEngineCallback callback;
+    void* userdata;
+} EngineTransfer;
+
+struct FetchEngine {
+    CURLM* multi;
+    int epoll_fd;
+    int timer_fd; // libcurl's own timeout
+    int queue_fd; // wakes the loop when a queued transfer may start (scheduler, retry backoff)
+    EngineTransfer* queue_head; // submitted but not yet handed to libcurl, FIFO
+    EngineTransfer* queue_tail;
+    EngineTransfer* started; // handed to libcurl and not yet completed
+};
+
+static double engine_now_ms() {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1000.0 + ts.tv_nsec / 1000000.0;
+}
+
+// A negative _Milliseconds disarms the timer. Zero still has to fire, so it becomes 1 ns.
+static void engine_arm_timer(int _Fd, long _Milliseconds) {
+    struct itimerspec its;
+    memset(&its, 0, sizeof(its));
+    if(_Milliseconds == 0) {
+        its.it_value.tv_nsec = 1;
+    } else if(_Milliseconds > 0) {
+        its.it_value.tv_sec = _Milliseconds / 1000;
+        its.it_value.tv_nsec = (_Milliseconds % 1000) * 1000000L;
+    }
+    timerfd_settime(_Fd, 0, &its, NULL);
+}
+
+static void engine_drain_timer(int _Fd) {
+    uint64_t expirations;
+    if(read(_Fd, &expirations, sizeof(expirations)) < 0 && errno != EAGAIN)
+        perror("read timerfd");
+}
+
+// CURLMOPT_SOCKETFUNCTION: mirror libcurl's interest in a socket into the epoll set
+static int engine_socket_callback(CURL* _Easy, curl_socket_t _Socket, int _What, void* _UserPtr, void* _SocketPtr) {
+    (void)_Easy;
+    FetchEngine* engine = (FetchEngine*)_UserPtr;
+
+    if(_What == CURL_POLL_REMOVE) {
+        epoll_ctl(engine->epoll_fd, EPOLL_CTL_DEL, _Socket, NULL);
+        curl_multi_assign(engine->multi, _Socket, NULL);
+        return 0;
+    }
+
+    struct epoll_event event;
+    memset(&event, 0, sizeof(event));
+    event.data.fd = _Socket;
+    if(_What & CURL_POLL_IN)
+        event.events |= EPOLLIN;
+    if(_What & CURL_POLL_OUT)
+        event.events |= EPOLLOUT;
+
+    if(_SocketPtr == NULL) {
+        // A recycled descriptor number can still be registered if its REMOVE raced a close
+        if(epoll_ctl(engine->epoll_fd, EPOLL_CTL_ADD, _Socket, &event) < 0 && errno == EEXIST)
+            epoll_ctl(engine->epoll_fd, EPOLL_CTL_MOD, _Socket, &event);
+        curl_multi_assign(engine->multi, _Socket, engine); // any non-NULL value marks it as known
+    } else {
+        epoll_ctl(engine->epoll_fd, EPOLL_CTL_MOD, _Socket, &event);
+    }
+
+    return 0;
+}
+
+// CURLMOPT_TIMERFUNCTION
+static int engine_timer_callback(CURLM* _Multi, long _TimeoutMs, void* _UserPtr) {
+    (void)_Multi;
+    FetchEngine* engine = (FetchEngine*)_UserPtr;
+    engine_arm_timer(engine->timer_fd, _TimeoutMs);
+    return 0;
+}
+
+static size_t engine_write_callback(void* _Contents, size_t _Size, size_t _Nmemb, void* _UserPtr) {
+    size_t realsize = _Size * _Nmemb;
+    EngineTransfer* transfer = (EngineTransfer*)_UserPtr;
+
+    // First bytes: take a buffer sized for the whole body (Content-Length, else what this
+    // endpoint sent before). Not earlier, as thousands of transfers may wait for a connection.
+    if(transfer->data == NULL) {
+        curl_off_t length = -1;
+        curl_easy_getinfo(transfer->handle, CURLINFO_CONTENT_LENGTH_DOWNLOAD_T, &length);
+        transfer->data = buffer_acquire(length > 0 ? (size_t)length + 1 : buffer_size_hint(transfer->url));
+    }
+
+    if(buffer_append(&transfer->data, &transfer->size, _Contents, realsize) != 0) {
+        printf("not enough memory for response buffer\n");
+        return 0;
+    }
+    return realsize;
+}
+
+static int engine_watch(FetchEngine* _Engine, int _Fd) {
+    struct epoll_event event;
+    memset(&event, 0, sizeof(event));
+    event.events = EPOLLIN;
+    event.data.fd = _Fd;
+    return epoll_ctl(_Engine->epoll_fd, EPOLL_CTL_ADD, _Fd, &event);
+}
+
+int engine_init(FetchEngine** _EnginePtr, int _MaxConnections) {
+    if(_EnginePtr == NULL)
+        return -1;
+
+    FetchEngine* engine = (FetchEngine*)calloc(1, sizeof(FetchEngine));
+    if(engine == NULL)
+        return -2;
+
+    engine->epoll_fd = epoll_create1(EPOLL_CLOEXEC);
+    engine->timer_fd = timerfd_create(CLOCK_MONOTONIC, TFD_NONBLOCK | TFD_CLOEXEC);
+    engine->queue_fd = timerfd_create(CLOCK_MONOTONIC, TFD_NONBLOCK | TFD_CLOEXEC);
+    engine->multi = curl_multi_init();
+    if(engine->epoll_fd < 0 || engine->timer_fd < 0 || engine->queue_fd < 0 || engine->multi == NULL ||
+       engine_watch(engine, engine->timer_fd) < 0 || engine_watch(engine, engine->queue_fd) < 0) {
+        perror("engine_init");
+        engine_dispose(&engine);
+        return -3;
+    }
+
+    http_configure_multi(engine->multi);
+    curl_multi_setopt(engine->multi, CURLMOPT_SOCKETFUNCTION, engine_socket_callback);
+    curl_multi_setopt(engine->multi, CURLMOPT_SOCKETDATA, engine);
+    curl_multi_setopt(engine->multi, CURLMOPT_TIMERFUNCTION, engine_timer_callback);
+    curl_multi_setopt(engine->multi, CURLMOPT_TIMERDATA, engine);
+    if(_MaxConnections > 0)
+        curl_multi_setopt(engine->multi, CURLMOPT_MAX_TOTAL_CONNECTIONS, (long)_MaxConnections);
+
+    *(_EnginePtr) = engine;
+    return 0;
+}
+
+static void engine_enqueue(FetchEngine* _Engine, EngineTransfer* _Transfer) {
+    _Transfer->next = NULL;
+    if(_Engine->queue_tail != NULL)
+        _Engine->queue_tail->next = _Transfer;
+    else
+        _Engine->queue_head = _Transfer;
+    _Engine->queue_tail = _Transfer;
+}
+
+int engine_submit(FetchEngine* _Engine, const char* _Url, FetchEngineCallback _Callback, void* _Userdata) {
+    if(_Engine == NULL || _Url == NULL || _Callback == NULL)
+        return -1;
+
+    EngineTransfer* transfer = (EngineTransfer*)calloc(1, sizeof(EngineTransfer));
+    if(transfer == NULL)
+        return -2;
+
+    transfer->url = strdup(_Url);
+    if(transfer->url == NULL) {
+        free(transfer);
+        return -2;
+    }
+
+    transfer->priority = scheduler_thread_class();
+    transfer->callback = _Callback;
+    transfer->userdata = _Userdata;
+    engine_enqueue(_Engine, transfer);
+    return 0;
+}
+
+static void engine_complete(EngineTransfer* _Transfer, char* _Data, long _Status) {
+    _Transfer->callback(_Transfer->url, _Data, _Data != NULL ? _Transfer->size : 0, _Status, _Transfer->userdata);
+    free(_Transfer->url);
+    free(_Transfer);
+}
+
+// _Target is the URL on the endpoint picked for this attempt; libcurl keeps its own copy
+static int engine_start(FetchEngine* _Engine, EngineTransfer* _Transfer, const char* _Target) {
+    _Transfer->handle = http_acquire_handle();
+    if(_Transfer->handle == NULL)
+        return -1;
+
+    _Transfer->data = NULL;
+    _Transfer->size = 0;
+    _Transfer->attempts++;
+    curl_easy_setopt(_Transfer->handle, CURLOPT_URL, _Target);
+    curl_easy_setopt(_Transfer->handle, CURLOPT_WRITEFUNCTION, engine_write_callback);
+    curl_easy_setopt(_Transfer->handle, CURLOPT_WRITEDATA, (void*)_Transfer);
+    curl_easy_setopt(_Transfer->handle, CURLOPT_PRIVATE, (void*)_Transfer);
+    if(capture_mode() == Capture_Mode_Record) {
+        curl_easy_setopt(_Transfer->handle, CURLOPT_HEADERFUNCTION, capture_append);
+        curl_easy_setopt(_Transfer->handle, CURLOPT_HEADERDATA, (void*)&_Transfer->headers);
+    }
+
+    _Transfer->started_at = engine_now_ms();
+    if(curl_multi_add_handle(_Engine->multi, _Transfer->handle) != CURLM_OK) {
+        http_release_handle(_Transfer->handle);
+        _Transfer->handle = NULL;
+        buffer_release(_Transfer->data);
+        _Transfer->data = NULL;
+        return -1;
+    }
+
+    _Transfer->previous = NULL;
+    _Transfer->next = _Engine->started;
+    if(_Engine->started != NULL)
+        _Engine->started->previous = _Transfer;
+    _Engine->started = _Transfer;
+    return 0;
+}
+
+// Completes an attempt: delivers a 200, queues a retry, or gives up
+static void engine_finish(FetchEngine* _Engine, EngineTransfer* _Transfer, CURLcode _Result, long _Code) {
+    if(_Result == CURLE_OK && _Code == 200) {
+        buffer_record_size(_Transfer->url, _Transfer->size);
+        engine_complete(_Transfer, _Transfer->data, _Code);
+        return;
+    }
+
+    if(_Result != CURLE_OK)
+        fprintf(stderr, "Transfer of %s failed: %s\n", _Transfer->url, curl_easy_strerror(_Result));
+    else
+        fprintf(stderr, "Transfer of %s failed: HTTP %ld\n", _Transfer->url, _Code);
+
+    buffer_release(_Transfer->data);
+    _Transfer->data = NULL;
+
+    if(_Transfer->attempts < HTTP_MAX_ATTEMPTS && http_is_retryable(_Result, _Code)) {
+        _Transfer->ready_at = engine_now_ms() + http_backoff_ms(_Transfer->attempts);
+        engine_enqueue(_Engine, _Transfer);
+    } else {
+        engine_complete(_Transfer, NULL, _Code);
+    }
+}
+
+// Answers an attempt from the capture archive instead of the network. With original timing
+// the transfer first goes back into the queue until its recorded time has passed.
+static void engine_replay(FetchEngine* _Engine, EngineTransfer* _Transfer) {
+    const CaptureEntry* entry = _Transfer->replay;
+    if(entry == NULL) {
+        entry = capture_find(_Transfer->url);
+        if(entry == NULL) {
+            fprintf(stderr, "No recorded response for %s\n", _Transfer->url);
+            engine_complete(_Transfer, NULL, 0);
+            return;
+        }
+
+        if(capture_timing() && entry->elapsed_ms > 0) {
+            _Transfer->replay = entry;
+            _Transfer->ready_at = engine_now_ms() + entry->elapsed_ms;
+            engine_enqueue(_Engine, _Transfer);
+            return;
+        }
+    }
+
+    _Transfer->replay = NULL;
+    _Transfer->attempts++;
+    _Transfer->data = entry->body != NULL ? buffer_copy(entry->body, entry->body_size) : NULL;
+    _Transfer->size = entry->body != NULL ? entry->body_size : 0;
+    engine_finish(_Engine, _Transfer, (CURLcode)entry->result, entry->status);
+}
+
+static void engine_dequeue(FetchEngine* _Engine, EngineTransfer* _Previous, EngineTransfer* _Transfer) {
+    if(_Previous != NULL)
+        _Previous->next = _Transfer->next;
+    else
+        _Engine->queue_head = _Transfer->next;
+    if(_Engine->queue_tail == _Transfer)
+        _Engine->queue_tail = _Previous;
+}
+
+// Hands every queued transfer whose backoff has passed to libcurl (or, when replaying, to the
+// capture archive) as far as the scheduler admits them, then arms queue_fd for whenever the
+// next one may go. Transfers queued while this runs, retries and new submissions alike, are visited too.
+static void engine_start_queued(FetchEngine* _Engine) {
+    double now = engine_now_ms();
+    double wake_at = -1;
+    int replaying = capture_mode() == Capture_Mode_Replay;
+    EngineTransfer* previous = NULL;
+    EngineTransfer* transfer = _Engine->queue_head;
+
+    while(transfer != NULL) {
+        if(transfer->ready_at > now) {
+            if(wake_at < 0 || transfer->ready_at < wake_at)
+                wake_at = transfer->ready_at;
+            previous = transfer;
+            transfer = transfer->next;
+            continue;
+        }
+
+        // An open circuit fails fast without spending a slot or token
+        if(!replaying && !endpoint_available(transfer->url)) {
+            engine_dequeue(_Engine, previous, transfer);
+            fprintf(stderr, "No upstream for %s is available, failing fast\n", transfer->url);
+            engine_complete(transfer, NULL, 0);
+            transfer = previous != NULL ? previous->next : _Engine->queue_head;
+            continue;
+        }
+
+        if(!replaying) {
+            long long wait_ns = scheduler_try_admit(transfer->priority);
+            if(wait_ns > 0) {
+                double admit_at = now + wait_ns / 1000000.0;
+                if(wake_at < 0 || admit_at < wake_at)
+                    wake_at = admit_at;
+                break; // nothing behind it is admitted either
+            }
+        }
+
+        // Started, answered or failed, in any case it leaves the queue for now
+        engine_dequeue(_Engine, previous, transfer);
+
+        if(replaying) {
+            engine_replay(_Engine, transfer);
+        } else {
+            char target[HTTP_MAX_URL_LENGTH];
+            if(endpoint_acquire(transfer->url, target, sizeof(target)) != 0)
+                fprintf(stderr, "No upstream for %s is available, failing fast\n", transfer->url);
+            else if(engine_start(_Engine, transfer, target) < 0) {
+                fprintf(stderr, "Failed to start transfer of %s\n", transfer->url);
+                endpoint_release(target);
+            }
+
+            if(transfer->handle == NULL) {
+                scheduler_release(transfer->priority);
+                engine_complete(transfer, NULL, 0);
+            }
+        }
+
+        transfer = previous != NULL ? previous->next : _Engine->queue_head;
+    }
+
+    engine_arm_timer(_Engine->queue_fd, wake_at < 0 ? -1 : (wake_at > now ? (long)(wake_at - now) + 1 : 0));
+}
+
+static void engine_check_completed(FetchEngine* _Engine) {
+    CURLMsg* message;
+    int remaining;
+    while((message = curl_multi_info_read(_Engine->multi, &remaining)) != NULL) {
+        if(message->msg != CURLMSG_DONE)
+            continue;
+
+        CURL* handle = message->easy_handle;
+        CURLcode res = message->data.result;
+        EngineTransfer* transfer = NULL;
+        long code = 0;
+        curl_easy_getinfo(handle, CURLINFO_PRIVATE, (char**)&transfer);
+        curl_easy_getinfo(handle, CURLINFO_RESPONSE_CODE, &code);
+
+        // The endpoint it went to; read before the handle is reset for reuse
+        double elapsed = engine_now_ms() - transfer->started_at;
+        char* target = NULL;
+        curl_easy_getinfo(handle, CURLINFO_EFFECTIVE_URL, &target);
+        endpoint_report(target, elapsed, http_is_healthy(res, code));
+
+        curl_multi_remove_handle(_Engine->multi, handle);
+        http_release_handle(handle);
+        transfer->handle = NULL;
+        scheduler_finish(transfer->priority, elapsed, http_is_healthy(res, code));
+
+        if(transfer->previous != NULL)
+            transfer->previous->next = transfer->next;
+        else
+            _Engine->started = transfer->next;
+        if(transfer->next != NULL)
+            transfer->next->previous = transfer->previous;
+
+        if(capture_mode() == Capture_Mode_Record) {
+            capture_record(transfer->url, res, code, elapsed,
+                           transfer->headers.data, transfer->data, transfer->size);
+            capture_buffer_free(&transfer->headers);
+        }
+
+        engine_finish(_Engine, transfer, res, code);
+    }
+}
+
+int engine_run(FetchEngine* _Engine) {
+    if(_Engine == NULL)
+        return -1;
+
+    struct epoll_event events[ENGINE_MAX_EVENTS];
+    int running = 0;
+
+    engine_start_queued(_Engine);
+    while(_Engine->started != NULL || _Engine->queue_head != NULL) {
+        int count = epoll_wait(_Engine->epoll_fd, events, ENGINE_MAX_EVENTS, -1);
+        if(count < 0) {
+            if(errno == EINTR)
+                continue;
+            perror("epoll_wait");
+            return -2;
+        }
+
+        for(int i = 0; i < count; i++) {
+            int fd = events[i].data.fd;
+            if(fd == _Engine->timer_fd) {
+                engine_drain_timer(fd);
+                curl_multi_socket_action(_Engine->multi, CURL_SOCKET_TIMEOUT, 0, &running);
+            } else if(fd == _Engine->queue_fd) {
+                engine_drain_timer(fd); // engine_start_queued below does the work
+            } else {
+                int flags = 0;
+                if(events[i].events & EPOLLIN)
+                    flags |= CURL_CSELECT_IN;
+                if(events[i].events & EPOLLOUT)
+                    flags |= CURL_CSELECT_OUT;
+                if(events[i].events & (EPOLLERR | EPOLLHUP))
+                    flags |= CURL_CSELECT_ERR;
+                curl_multi_socket_action(_Engine->multi, fd, flags, &running);
+            }
+
+            // Right away, so finished bodies go back to the pool before the next socket reuses one
+            engine_check_completed(_Engine);
+        }
+
+        engine_start_queued(_Engine);
+    }
+
+    return 0;
+}
+
+void engine_dispose(FetchEngine** _EnginePtr) {
+    if(_EnginePtr == NULL || *(_EnginePtr) == NULL)
+        return;
+
+    FetchEngine* engine = *(_EnginePtr);
+
+    EngineTransfer* transfer = engine->started;
+    while(transfer != NULL) {
+        EngineTransfer* next = transfer->next;
+        curl_multi_remove_handle(engine->multi, transfer->handle);
+        http_release_handle(transfer->handle);
+        scheduler_release(transfer->priority);
+        capture_buffer_free(&transfer->headers);
+        buffer_release(transfer->data);
+        free(transfer->url);
+        free(transfer);
+        transfer = next;
+    }
+
+    transfer = engine->queue_head;
+    while(transfer != NULL) {
+        EngineTransfer* next = transfer->next;
+        free(transfer->url);
+        free(transfer);
+        transfer = next;
+    }
+
+    if(engine->multi != NULL)
+        curl_multi_cleanup(engine->multi);
+
+    if(engine->epoll_fd >= 0)
+        close(engine->epoll_fd);
+    if(engine->timer_fd >= 0)
+        close(engine->timer_fd);
+    if(engine->queue_fd >= 0)
+        close(engine->queue_fd);
+
+    free(engine);
+    *(_EnginePtr) = NULL;
+}
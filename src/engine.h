@@ -0,0 +1,33 @@
+#ifndef Engine_h__
+#define Engine_h__
+
+#include <stddef.h>
+
+/*
+ * Single-threaded, event-driven fetch engine: one epoll set carries every socket libcurl
+ * opens plus a timerfd for libcurl's timeouts, driven through curl_multi_socket_action.
+ * Submitted transfers cost a few hundred bytes until they start, so thousands can be
+ * queued at once; connections are capped separately. Transfers go through the same scheduler,
+ * circuit breaker and retry policy as http_fetch, in the class of the thread that submitted them.
+ */
+
+typedef struct FetchEngine FetchEngine;
+
+// Called once per submitted URL when it is done. _Data is the NUL-terminated body of a 200
+// response (owned by the callback, released with http_free) or NULL on failure; _Status is
+// the last HTTP status, 0 if none.
+typedef void (*FetchEngineCallback)(const char* _Url, char* _Data, size_t _Size, long _Status, void* _Userdata);
+
+// _MaxConnections caps concurrent connections; transfers beyond it wait inside libcurl
+int engine_init(FetchEngine** _EnginePtr, int _MaxConnections);
+
+// Queues a transfer. Safe to call from a completion callback while engine_run is running.
+int engine_submit(FetchEngine* _Engine, const char* _Url, FetchEngineCallback _Callback, void* _Userdata);
+
+// Runs the event loop until every submitted transfer has completed
+int engine_run(FetchEngine* _Engine);
+
+// Transfers that have not completed are dropped without calling their callback
+void engine_dispose(FetchEngine** _EnginePtr);
+
+#endif // Engine_h__
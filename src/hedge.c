@@ -0,0 +1,93 @@
+#include "hedge.h"
+
+#include <stdlib.h>
+#include <string.h>
+#include <pthread.h>
+
+static double percentile = 0; // <= 0: off
+static double budget = HEDGE_DEFAULT_BUDGET;
+static double credit = 0;
+
+static double history[HEDGE_HISTORY];
+static int history_count = 0;
+static int history_next = 0;
+static long delay_ms = -1;
+
+static pthread_mutex_t hedge_lock = PTHREAD_MUTEX_INITIALIZER;
+
+static int hedge_compare(const void* _A, const void* _B) {
+    double a = *(const double*)_A, b = *(const double*)_B;
+    return (a > b) - (a < b);
+}
+
+// Must be called with hedge_lock held
+static void hedge_update_delay() {
+    if(percentile <= 0 || history_count < HEDGE_MIN_SAMPLES) {
+        delay_ms = -1;
+        return;
+    }
+
+    double sorted[HEDGE_HISTORY];
+    memcpy(sorted, history, sizeof(double) * history_count);
+    qsort(sorted, history_count, sizeof(double), hedge_compare);
+
+    int index = (int)(history_count * percentile / 100.0);
+    if(index >= history_count)
+        index = history_count - 1;
+
+    delay_ms = (long)sorted[index];
+    if(delay_ms < HEDGE_MIN_DELAY_MS)
+        delay_ms = HEDGE_MIN_DELAY_MS;
+}
+
+void hedge_configure(double _Percentile, double _Budget) {
+    pthread_mutex_lock(&hedge_lock);
+    percentile = _Percentile < 100 ? _Percentile : 99.9;
+    budget = _Budget < 0 ? 0 : (_Budget > 1 ? 1 : _Budget);
+    credit = 0;
+    hedge_update_delay();
+    pthread_mutex_unlock(&hedge_lock);
+}
+
+void hedge_begin() {
+    pthread_mutex_lock(&hedge_lock);
+    if(percentile > 0) {
+        credit += budget;
+        if(credit > HEDGE_MAX_CREDIT)
+            credit = HEDGE_MAX_CREDIT;
+    }
+    pthread_mutex_unlock(&hedge_lock);
+}
+
+long hedge_delay_ms() {
+    pthread_mutex_lock(&hedge_lock);
+    long delay = delay_ms;
+    pthread_mutex_unlock(&hedge_lock);
+    return delay;
+}
+
+int hedge_try_acquire() {
+    int allowed = 0;
+
+    pthread_mutex_lock(&hedge_lock);
+    if(percentile > 0 && credit >= 1.0) {
+        credit -= 1.0;
+        allowed = 1;
+    }
+    pthread_mutex_unlock(&hedge_lock);
+
+    return allowed;
+}
+
+void hedge_record(double _Milliseconds) {
+    pthread_mutex_lock(&hedge_lock);
+    history[history_next] = _Milliseconds;
+    history_next = (history_next + 1) % HEDGE_HISTORY;
+    if(history_count < HEDGE_HISTORY)
+        history_count++;
+
+    // Re-sorting on every sample is wasted work; the percentile barely moves between them
+    if(history_count == HEDGE_MIN_SAMPLES || history_next % 8 == 0)
+        hedge_update_delay();
+    pthread_mutex_unlock(&hedge_lock);
+}
@@ -0,0 +1,34 @@
+#ifndef Hedge_h__
+#define Hedge_h__
+
+/*
+ * Hedging policy for single fetches: when a response has not started within a percentile of
+ * recent response times, a duplicate request is sent and whichever responds first is used.
+ * Every request earns _Budget hedge credits and a hedge spends one, so with the budget capped
+ * at 1.0 hedges can never outnumber the requests they duplicate.
+ */
+
+#define HEDGE_HISTORY 128 // recent response times the percentile is taken over
+#define HEDGE_MIN_SAMPLES 16 // no hedging until this many have been seen
+#define HEDGE_MIN_DELAY_MS 5
+#define HEDGE_MAX_CREDIT 10.0 // unused credit is capped so a quiet period cannot fund a burst
+
+#define HEDGE_DEFAULT_PERCENTILE 95.0
+#define HEDGE_DEFAULT_BUDGET 0.05
+
+// _Percentile in (0, 100), <= 0 turns hedging off (the default). _Budget is clamped to [0, 1].
+void hedge_configure(double _Percentile, double _Budget);
+
+// Called once per request (not per hedge); earns its share of hedge credit
+void hedge_begin();
+
+// Milliseconds to wait for a response before hedging, or -1 if hedging is off or still warming up
+long hedge_delay_ms();
+
+// Spends a credit and returns 1 if a hedge may be sent, otherwise returns 0
+int hedge_try_acquire();
+
+// Time from sending a request until its response started
+void hedge_record(double _Milliseconds);
+
+#endif // Hedge_h__
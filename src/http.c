@@ -1,59 +1,1111 @@
+#define _POSIX_C_SOURCE 200809L
+
 #include "http.h"
+#include "request.h"
+#include "endpoint.h"
+#include "ratelimit.h"
+#include "scheduler.h"
+#include "hedge.h"
+#include "capture.h"
+#include "buffer.h"
 #include <stdlib.h>
+#include <stdint.h>
 #include <string.h>
+#include <strings.h>
+#include <time.h>
+#include <pthread.h>
+
+// Number of idle easy handles kept around between fetches
+#define HTTP_POOL_SIZE 8
 
-#define CITY_WEATHER_API_URL "https://api.open-meteo.com/v1/forecast?latitude=%f&longitude=%f&current=temperature_2m,relative_humidity_2m,apparent_temperature,is_day,precipitation,rain,showers,snowfall,weather_code,cloud_cover,pressure_msl,surface_pressure,wind_speed_10m,wind_direction_10m,wind_gusts_10m"
+// Upper bounds so a hanging upstream cannot stall a fetch indefinitely
+#define HTTP_CONNECT_TIMEOUT_MS 5000
+#define HTTP_TIMEOUT_MS 15000
 
+// Response body in a pooled buffer (see buffer.h)
 struct MemoryStruct {
     char *memory;
     size_t size;
+    CURL *handle; // the transfer writing it, once known; used to size for Content-Length
+};
+
+// One in-flight transfer of http_fetch_many
+typedef struct {
+    CURL *handle;
+    HttpRequest *request;
+    struct MemoryStruct chunk;
+    char url[HTTP_MAX_URL_LENGTH];
+    char target[HTTP_MAX_URL_LENGTH]; // url on the endpoint picked for the current attempt
+    int attempts;
+    double ready_at; // a retry must not start before this (monotonic ms)
+    double started_at;
+    CaptureBuffer headers; // only collected while recording
+    Scheduler_Class priority;
+} HttpTransfer;
+
+typedef size_t (*HttpWriteFunction)(void *contents, size_t size, size_t nmemb, void *userp);
+
+typedef struct HttpRace HttpRace;
+
+// One request of a race, the original or its hedge
+typedef struct {
+    HttpRace *race;
+    CURL *handle;
+    HttpValidators received;
+    CaptureBuffer header_block; // only collected while recording
+    double started_at;
+    int done;
+    CURLcode result;
+} HttpLeg;
+
+// A single fetch, raced against a hedged duplicate when the response is slow to start.
+// The leg whose response starts first wins; the other aborts from its header callback,
+// so only the winner ever writes to the shared body sink.
+struct HttpRace {
+    CURLM *multi;
+    HttpLeg legs[2];
+    int count;
+    HttpLeg *winner;
+    const char *url; // as built, which is what the capture archive is keyed on
+    const char *target; // url on the endpoint picked for this attempt
+    struct curl_slist *headers;
+    HttpWriteFunction write;
+    void *write_data;
+    int hedge_checked;
+    int done;
+    CURLcode result;
+    double finished_at;
+    CURL **winner_handle; // if set, told which handle won (before any body is written)
+    Scheduler_Class priority; // the caller admits the original, the hedge admits itself
 };
 
+// State shared by the curl write callback and the jansson load callback in streaming mode.
+// Holds at most one chunk; the transfer is paused while the parser has not consumed it.
+typedef struct {
+    HttpRace race;
+    CaptureBuffer body; // copy of everything handed to the parser, only while recording
+    char buffer[CURL_MAX_WRITE_SIZE];
+    size_t offset;
+    size_t pending;
+    int paused;
+} HttpStream;
+
+static char ca_file[256] = "";
+
+// HTTP/2 over TLS with many streams per connection; falls back to HTTP/1.1 keep-alive
+// whenever the server does not offer h2 (and always for plain http://)
+static int multiplex = 1;
+
+// DNS cache, TLS sessions and live connections are shared by every handle in the pool
+static CURLSH *share = NULL;
+static pthread_mutex_t share_locks[CURL_LOCK_DATA_LAST];
+
+static CURL *pool[HTTP_POOL_SIZE];
+static int pool_count = 0;
+static pthread_mutex_t pool_lock = PTHREAD_MUTEX_INITIALIZER;
+
 static size_t WriteMemoryCallback(void *contents, size_t size, size_t nmemb, void *userp) {
     size_t realsize = size * nmemb;
     struct MemoryStruct *mem = (struct MemoryStruct *)userp;
 
-    char *ptr = realloc(mem->memory, mem->size + realsize + 1);
-    if(ptr == NULL) return 0; // out of memory
+    // First bytes: make room for the whole body at once if the server said how big it is
+    if(mem->size == 0 && mem->handle != NULL) {
+        curl_off_t length = -1;
+        curl_easy_getinfo(mem->handle, CURLINFO_CONTENT_LENGTH_DOWNLOAD_T, &length);
+        if(length > 0) {
+            char *sized = buffer_grow(mem->memory, 0, (size_t)length + 1);
+            if(sized != NULL)
+                mem->memory = sized;
+        }
+    }
+
+    if(buffer_append(&mem->memory, &mem->size, contents, realsize) != 0)
+        return 0; // out of memory
+    return realsize;
+}
+
+static void copy_header_value(char *dest, size_t size, const char *value, size_t length) {
+    while(length > 0 && (*value == ' ' || *value == '\t')) {
+        value++;
+        length--;
+    }
+    while(length > 0 && (value[length - 1] == '\r' || value[length - 1] == '\n' || value[length - 1] == ' '))
+        length--;
+
+    if(length >= size)
+        length = size - 1;
+    memcpy(dest, value, length);
+    dest[length] = '\0';
+}
+
+// Picks ETag and Last-Modified out of the response headers
+static size_t HeaderCallback(char *buffer, size_t size, size_t nitems, void *userp) {
+    size_t realsize = size * nitems;
+    HttpValidators *validators = (HttpValidators *)userp;
+
+    if(realsize > 5 && strncasecmp(buffer, "ETag:", 5) == 0)
+        copy_header_value(validators->etag, sizeof(validators->etag), buffer + 5, realsize - 5);
+    else if(realsize > 14 && strncasecmp(buffer, "Last-Modified:", 14) == 0)
+        copy_header_value(validators->last_modified, sizeof(validators->last_modified), buffer + 14, realsize - 14);
+
+    return realsize;
+}
+
+static size_t StreamWriteCallback(void *contents, size_t size, size_t nmemb, void *userp) {
+    size_t realsize = size * nmemb;
+    HttpStream *stream = (HttpStream *)userp;
+
+    if(stream->pending > 0) {
+        stream->paused = 1; // curl keeps the chunk and delivers it again on unpause
+        return CURL_WRITEFUNC_PAUSE;
+    }
+
+    if(realsize > sizeof(stream->buffer))
+        return 0;
 
-    mem->memory = ptr;
-    memcpy(&(mem->memory[mem->size]), contents, realsize);
-    mem->size += realsize;
-    mem->memory[mem->size] = 0; // null terminate
+    memcpy(stream->buffer, contents, realsize);
+    stream->offset = 0;
+    stream->pending = realsize;
+    if(capture_mode() == Capture_Mode_Record)
+        capture_append(contents, 1, realsize, &stream->body);
     return realsize;
 }
 
+static double http_now_ms() {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1000.0 + ts.tv_nsec / 1000000.0;
+}
+
+static void http_sleep_ms(long ms) {
+    struct timespec ts;
+    ts.tv_sec = ms / 1000;
+    ts.tv_nsec = (ms % 1000) * 1000000L;
+    nanosleep(&ts, NULL);
+}
+
+static size_t RaceHeaderCallback(char *buffer, size_t size, size_t nitems, void *userp) {
+    HttpLeg *leg = (HttpLeg *)userp;
+    HttpRace *race = leg->race;
+
+    if(race->winner == NULL) {
+        race->winner = leg;
+        if(race->winner_handle != NULL)
+            *race->winner_handle = leg->handle;
+        hedge_record(http_now_ms() - leg->started_at);
+    } else if(race->winner != leg) {
+        return 0; // lost the race
+    }
+
+    if(capture_mode() == Capture_Mode_Record)
+        capture_append(buffer, size, nitems, &leg->header_block);
+    return HeaderCallback(buffer, size, nitems, &leg->received);
+}
+
+static int http_race_add_leg(HttpRace *race) {
+    HttpLeg *leg = &race->legs[race->count];
+    memset(leg, 0, sizeof(HttpLeg));
+    leg->race = race;
+    leg->handle = http_acquire_handle();
+    if(leg->handle == NULL)
+        return -1;
+
+    curl_easy_setopt(leg->handle, CURLOPT_URL, race->target);
+    curl_easy_setopt(leg->handle, CURLOPT_WRITEFUNCTION, race->write);
+    curl_easy_setopt(leg->handle, CURLOPT_WRITEDATA, race->write_data);
+    curl_easy_setopt(leg->handle, CURLOPT_HEADERFUNCTION, RaceHeaderCallback);
+    curl_easy_setopt(leg->handle, CURLOPT_HEADERDATA, (void *)leg);
+    if(race->headers != NULL)
+        curl_easy_setopt(leg->handle, CURLOPT_HTTPHEADER, race->headers);
+
+    leg->started_at = http_now_ms();
+    if(curl_multi_add_handle(race->multi, leg->handle) != CURLM_OK) {
+        http_release_handle(leg->handle);
+        return -1;
+    }
+
+    race->count++;
+    return 0;
+}
+
+static int http_race_start(HttpRace *race, const char *url, const char *target, struct curl_slist *headers, HttpWriteFunction write, void *writeData) {
+    memset(race, 0, sizeof(HttpRace));
+    race->url = url;
+    race->target = target;
+    race->headers = headers;
+    race->write = write;
+    race->write_data = writeData;
+    race->priority = scheduler_thread_class();
+
+    race->multi = curl_multi_init();
+    if(race->multi == NULL)
+        return -1;
+    http_configure_multi(race->multi);
+
+    if(http_race_add_leg(race) != 0) {
+        curl_multi_cleanup(race->multi);
+        return -1;
+    }
+
+    hedge_begin();
+    return 0;
+}
+
+// Sends the duplicate once the original has waited longer than the hedge delay, budget, slots
+// and rate limit permitting. Checked once per race; a denied hedge is not retried.
+static void http_race_hedge(HttpRace *race) {
+    if(race->count != 1 || race->winner != NULL || race->hedge_checked)
+        return;
+
+    long delay = hedge_delay_ms();
+    if(delay < 0 || http_now_ms() - race->legs[0].started_at < delay)
+        return;
+
+    race->hedge_checked = 1;
+    if(!hedge_try_acquire() || scheduler_try_admit(race->priority) != 0)
+        return;
+
+    if(http_race_add_leg(race) != 0)
+        scheduler_release(race->priority);
+}
+
+static void http_race_perform(HttpRace *race) {
+    int running = 0;
+    curl_multi_perform(race->multi, &running);
+
+    CURLMsg *msg;
+    int left = 0;
+    while((msg = curl_multi_info_read(race->multi, &left)) != NULL) {
+        if(msg->msg != CURLMSG_DONE)
+            continue;
+        for(int i = 0; i < race->count; i++) {
+            if(race->legs[i].handle == msg->easy_handle) {
+                race->legs[i].done = 1;
+                race->legs[i].result = msg->data.result;
+            }
+        }
+    }
+
+    // The winner settles the race. Without one, a leg that failed before responding only
+    // settles it once no other leg is left that could still respond.
+    if(race->winner != NULL) {
+        race->done = race->winner->done;
+        race->result = race->winner->result;
+    } else {
+        race->done = 1;
+        for(int i = 0; i < race->count; i++) {
+            if(!race->legs[i].done)
+                race->done = 0;
+        }
+        race->result = race->legs[race->count - 1].result;
+    }
+
+    if(race->done)
+        race->finished_at = http_now_ms();
+    else
+        http_race_hedge(race);
+}
+
+// Waits for socket activity, but no longer than until the hedge is due
+static void http_race_wait(HttpRace *race) {
+    int timeout = 1000;
+
+    long delay = race->hedge_checked ? -1 : hedge_delay_ms();
+    if(race->count == 1 && delay >= 0) {
+        double due = race->legs[0].started_at + delay - http_now_ms();
+        if(due < timeout)
+            timeout = due > 0 ? (int)due + 1 : 0;
+    }
+
+    curl_multi_poll(race->multi, NULL, 0, timeout, NULL);
+}
+
+// The handle to read response info from
+static CURL* http_race_handle(HttpRace *race) {
+    return race->winner != NULL ? race->winner->handle : race->legs[0].handle;
+}
+
+// Appends the race's outcome to the capture archive when recording
+static void http_race_record(HttpRace *race, long code, const char *body, size_t size) {
+    if(capture_mode() != Capture_Mode_Record)
+        return;
+
+    const char *headers = race->winner != NULL ? race->winner->header_block.data : NULL;
+    double finished_at = race->done ? race->finished_at : http_now_ms();
+    capture_record(race->url, race->result, code, finished_at - race->legs[0].started_at, headers, body, size);
+}
+
+static void http_race_finish(HttpRace *race) {
+    for(int i = 0; i < race->count; i++) {
+        curl_multi_remove_handle(race->multi, race->legs[i].handle);
+        http_release_handle(race->legs[i].handle);
+        capture_buffer_free(&race->legs[i].header_block);
+    }
+    curl_multi_cleanup(race->multi);
+
+    if(race->count > 1)
+        scheduler_release(race->priority);
+}
+
+// Looks up the next recorded response for url and, if asked to, waits as long as it originally took
+static const CaptureEntry* http_replay_lookup(const char *url, CURLcode *res, long *code) {
+    const CaptureEntry *entry = capture_find(url);
+    if(entry == NULL) {
+        fprintf(stderr, "No recorded response for %s\n", url);
+        *res = CURLE_COULDNT_CONNECT;
+        *code = 0;
+        return NULL;
+    }
+
+    if(capture_timing())
+        http_sleep_ms((long)entry->elapsed_ms);
+
+    *res = (CURLcode)entry->result;
+    *code = entry->status;
+    return entry;
+}
+
+// Runs a recorded header block through HeaderCallback line by line
+static void http_replay_validators(const char *headers, HttpValidators *validators) {
+    memset(validators, 0, sizeof(HttpValidators));
+    while(headers != NULL && *headers != '\0') {
+        const char *end = strchr(headers, '\n');
+        size_t length = end != NULL ? (size_t)(end - headers) + 1 : strlen(headers);
+        HeaderCallback((char *)headers, 1, length, validators);
+        headers += length;
+    }
+}
+
+// Called by json_load_callback whenever the parser wants more input; drives the transfer until a chunk arrives
+static size_t StreamReadCallback(void *buffer, size_t buflen, void *data) {
+    HttpStream *stream = (HttpStream *)data;
+
+    while(stream->pending == 0) {
+        if(stream->race.done)
+            return stream->race.result == CURLE_OK ? 0 : (size_t)-1;
+
+        if(stream->paused) {
+            stream->paused = 0; // only the winner writes, so it is the one paused
+            curl_easy_pause(stream->race.winner->handle, CURLPAUSE_CONT);
+            continue;
+        }
+
+        http_race_perform(&stream->race);
+
+        if(stream->pending == 0 && !stream->race.done)
+            http_race_wait(&stream->race);
+    }
+
+    size_t size = stream->pending < buflen ? stream->pending : buflen;
+    memcpy(buffer, stream->buffer + stream->offset, size);
+    stream->offset += size;
+    stream->pending -= size;
+    return size;
+}
+
+// Per thread, so threads that fail in the same instant still draw different delays
+static __thread unsigned int backoff_seed = 0;
+static __thread int backoff_seeded = 0;
+
+// Full jitter: anywhere between zero and the capped exponential step, so clients that failed
+// together do not all retry together
+long http_backoff_ms(int attempt) {
+    long ceiling = HTTP_BACKOFF_BASE_MS;
+    while(--attempt > 0 && ceiling < HTTP_BACKOFF_MAX_MS)
+        ceiling *= 2;
+    if(ceiling > HTTP_BACKOFF_MAX_MS)
+        ceiling = HTTP_BACKOFF_MAX_MS;
+
+    if(!backoff_seeded) {
+        // The address of a thread-local differs per thread even when the clocks agree
+        backoff_seed = (unsigned int)(http_now_ms() * 1000.0) ^ (unsigned int)(uintptr_t)&backoff_seed;
+        backoff_seeded = 1;
+    }
+    return rand_r(&backoff_seed) % (ceiling + 1);
+}
+
+// Transport errors and an overloaded upstream are worth another try, malformed requests are not
+int http_is_retryable(CURLcode res, long code) {
+    if(res != CURLE_OK)
+        return res != CURLE_URL_MALFORMAT && res != CURLE_UNSUPPORTED_PROTOCOL && res != CURLE_WRITE_ERROR && res != CURLE_OUT_OF_MEMORY;
+    return code >= 500 || code == 429;
+}
+
+// What the circuit breaker counts as the host being unwell
+int http_is_healthy(CURLcode res, long code) {
+    return res == CURLE_OK && code < 500 && code != 429;
+}
+
+static void share_lock(CURL *handle, curl_lock_data data, curl_lock_access access, void *userptr) {
+    (void)handle; (void)access; (void)userptr;
+    pthread_mutex_lock(&share_locks[data]);
+}
+
+static void share_unlock(CURL *handle, curl_lock_data data, void *userptr) {
+    (void)handle; (void)userptr;
+    pthread_mutex_unlock(&share_locks[data]);
+}
+
+// Takes an idle handle from the pool (or creates one) and applies the options every fetch needs
+CURL* http_acquire_handle() {
+    CURL *curl_handle = NULL;
+
+    pthread_mutex_lock(&pool_lock);
+    if(pool_count > 0)
+        curl_handle = pool[--pool_count];
+    pthread_mutex_unlock(&pool_lock);
+
+    if(curl_handle == NULL) {
+        curl_handle = curl_easy_init();
+        if(curl_handle == NULL)
+            return NULL;
+    } else {
+        curl_easy_reset(curl_handle); // clears options, keeps the handle's caches
+    }
+
+    if(share != NULL)
+        curl_easy_setopt(curl_handle, CURLOPT_SHARE, share);
+    curl_easy_setopt(curl_handle, CURLOPT_TCP_KEEPALIVE, 1L);
+    curl_easy_setopt(curl_handle, CURLOPT_CONNECTTIMEOUT_MS, (long)HTTP_CONNECT_TIMEOUT_MS);
+    curl_easy_setopt(curl_handle, CURLOPT_TIMEOUT_MS, (long)HTTP_TIMEOUT_MS);
+    if(ca_file[0] != '\0')
+        curl_easy_setopt(curl_handle, CURLOPT_CAINFO, ca_file);
+    if(multiplex) {
+        curl_easy_setopt(curl_handle, CURLOPT_HTTP_VERSION, (long)CURL_HTTP_VERSION_2TLS);
+        curl_easy_setopt(curl_handle, CURLOPT_PIPEWAIT, 1L); // wait for a connection that may multiplex rather than open another
+    } else {
+        curl_easy_setopt(curl_handle, CURLOPT_HTTP_VERSION, (long)CURL_HTTP_VERSION_1_1);
+    }
+
+    return curl_handle;
+}
+
+void http_release_handle(CURL *curl_handle) {
+    pthread_mutex_lock(&pool_lock);
+    if(pool_count < HTTP_POOL_SIZE) {
+        pool[pool_count++] = curl_handle;
+        curl_handle = NULL;
+    }
+    pthread_mutex_unlock(&pool_lock);
+
+    if(curl_handle != NULL)
+        curl_easy_cleanup(curl_handle);
+}
+
 int http_init() {
-    curl_global_init(CURL_GLOBAL_ALL);
+    if(curl_global_init(CURL_GLOBAL_ALL) != CURLE_OK)
+        return -1;
+
+    for(int i = 0; i < CURL_LOCK_DATA_LAST; i++)
+        pthread_mutex_init(&share_locks[i], NULL);
+
+    share = curl_share_init();
+    if(share == NULL)
+        return -2;
+
+    curl_share_setopt(share, CURLSHOPT_LOCKFUNC, share_lock);
+    curl_share_setopt(share, CURLSHOPT_UNLOCKFUNC, share_unlock);
+    curl_share_setopt(share, CURLSHOPT_SHARE, CURL_LOCK_DATA_DNS);
+    curl_share_setopt(share, CURLSHOPT_SHARE, CURL_LOCK_DATA_SSL_SESSION);
+    curl_share_setopt(share, CURLSHOPT_SHARE, CURL_LOCK_DATA_CONNECT);
     return 0;
 }
 
+void http_set_base_url(const char* baseUrl) {
+    const char *base = baseUrl != NULL ? baseUrl : REQUEST_DEFAULT_BASE_URL;
+    http_set_endpoints(&base, 1);
+}
+
+int http_set_endpoints(const char** baseUrls, int count) {
+    return endpoint_configure(baseUrls, count);
+}
+
+void http_set_rate_limit(double requestsPerSecond, int burst) {
+    ratelimit_configure(requestsPerSecond, burst);
+}
+
+void http_set_scheduler(double backgroundShare) {
+    scheduler_configure(backgroundShare);
+}
+
+void http_set_concurrency(int initial, int min, int max) {
+    limit_configure(initial, min, max);
+}
+
+int http_concurrency_limit() {
+    return limit_current();
+}
+
+int http_concurrency_history(LimitChange* changes, int capacity) {
+    return limit_history(changes, capacity);
+}
+
+void http_set_hedging(double percentile, double budget) {
+    hedge_configure(percentile, budget);
+}
+
+int http_record(const char* archivePath) {
+    return capture_open(Capture_Mode_Record, archivePath, 0);
+}
+
+int http_replay(const char* archivePath, int originalTiming) {
+    return capture_open(Capture_Mode_Replay, archivePath, originalTiming);
+}
+
+void http_set_ca_file(const char* caFile) {
+    snprintf(ca_file, sizeof(ca_file), "%s", caFile != NULL ? caFile : "");
+}
+
+void http_set_multiplex(int enabled) {
+    multiplex = enabled != 0;
+}
+
+void http_configure_multi(CURLM* multi) {
+    curl_multi_setopt(multi, CURLMOPT_PIPELINING, multiplex ? (long)CURLPIPE_MULTIPLEX : (long)CURLPIPE_NOTHING);
+}
+
+int http_build_url(char* buffer, size_t size, double latitude, double longitude) {
+    if(http_build_batch_url(buffer, size, &latitude, &longitude, 1) != 1)
+        return -1;
+    return (int)strlen(buffer);
+}
+
+int http_build_batch_url(char* buffer, size_t size, const double* latitudes, const double* longitudes, int count) {
+    if(buffer == NULL || latitudes == NULL || longitudes == NULL || count <= 0)
+        return -1;
+
+    // Length of the URL without any coordinates, used to know when the lists must stop growing
+    char empty[HTTP_MAX_URL_LENGTH];
+    int fixed = request_build_url(empty, sizeof(empty), "", "");
+    if(fixed < 0)
+        return -1;
+
+    char latitude_list[HTTP_MAX_URL_LENGTH];
+    char longitude_list[HTTP_MAX_URL_LENGTH];
+    int latitude_length = 0;
+    int longitude_length = 0;
+    int used = 0;
+
+    // The lists are built locally, so they may not grow past these buffers whatever size allows
+    size_t limit = size < sizeof(latitude_list) ? size : sizeof(latitude_list);
+
+    for(int i = 0; i < count; i++) {
+        char latitude[32];
+        char longitude[32];
+        int a = snprintf(latitude, sizeof(latitude), "%s%.4f", i > 0 ? "," : "", latitudes[i]);
+        int b = snprintf(longitude, sizeof(longitude), "%s%.4f", i > 0 ? "," : "", longitudes[i]);
+
+        if((size_t)(fixed + latitude_length + a + longitude_length + b) >= limit)
+            break;
+
+        memcpy(latitude_list + latitude_length, latitude, a + 1);
+        memcpy(longitude_list + longitude_length, longitude, b + 1);
+        latitude_length += a;
+        longitude_length += b;
+        used++;
+    }
+
+    if(used == 0)
+        return -1;
+
+    if(request_build_url(buffer, size, latitude_list, longitude_list) < 0)
+        return -1;
+    return used;
+}
+
 char* http_fetch(double latitude, double longitude) {
-    char url[512];
-    snprintf(url, sizeof(url), CITY_WEATHER_API_URL, latitude, longitude);
-    CURL *curl_handle;
-    CURLcode res;
+    char url[HTTP_MAX_URL_LENGTH];
+    if(http_build_url(url, sizeof(url), latitude, longitude) < 0)
+        return NULL;
+    return http_fetch_url(url);
+}
+
+static char* http_fetch_once(const char* url, const char* target, CURLcode *res, long *code) {
+    if(capture_mode() == Capture_Mode_Replay) {
+        const CaptureEntry *entry = http_replay_lookup(url, res, code);
+        if(entry == NULL || *res != CURLE_OK || *code != 200 || entry->body == NULL)
+            return NULL;
+        return buffer_copy(entry->body, entry->body_size);
+    }
+
+    HttpRace race;
     struct MemoryStruct chunk;
-    chunk.memory = malloc(1);  // will be grown as needed by the realloc above
+    chunk.memory = buffer_acquire(buffer_size_hint(url)); // grown as needed by WriteMemoryCallback
     chunk.size = 0;    // no data at this point
-    curl_handle = curl_easy_init();
-    curl_easy_setopt(curl_handle, CURLOPT_URL, url);
-    curl_easy_setopt(curl_handle, CURLOPT_WRITEFUNCTION, WriteMemoryCallback);
-    curl_easy_setopt(curl_handle, CURLOPT_WRITEDATA, (void *)&chunk);
-
-    res = curl_easy_perform(curl_handle);
-    if(res != CURLE_OK) {
-        fprintf(stderr, "curl_easy_perform() failed: %s\n", curl_easy_strerror(res));
-        free(chunk.memory);
-        curl_easy_cleanup(curl_handle);
-        curl_global_cleanup();
+    chunk.handle = NULL;
+    if(chunk.memory == NULL || http_race_start(&race, url, target, NULL, WriteMemoryCallback, (void *)&chunk) != 0) {
+        buffer_release(chunk.memory);
+        *res = CURLE_OUT_OF_MEMORY;
         return NULL;
     }
-    curl_easy_cleanup(curl_handle);
-    curl_global_cleanup();
-    return chunk.memory; // caller is responsible for freeing this memory
+    race.winner_handle = &chunk.handle;
+
+    while(1) {
+        http_race_perform(&race);
+        if(race.done)
+            break;
+        http_race_wait(&race);
+    }
+
+    *res = race.result;
+    curl_easy_getinfo(http_race_handle(&race), CURLINFO_RESPONSE_CODE, code);
+    http_race_record(&race, *code, chunk.memory, chunk.size);
+    http_race_finish(&race);
+    if(*res != CURLE_OK) {
+        fprintf(stderr, "Transfer of %s failed: %s\n", target, curl_easy_strerror(*res));
+        buffer_release(chunk.memory);
+        return NULL;
+    }
+    if(*code != 200) {
+        fprintf(stderr, "Transfer of %s failed: HTTP %ld\n", target, *code);
+        buffer_release(chunk.memory);
+        return NULL;
+    }
+    buffer_record_size(url, chunk.size);
+    return chunk.memory; // caller releases it with http_free
+}
+
+char* http_fetch_url(const char* url) {
+    char target[HTTP_MAX_URL_LENGTH];
+    Scheduler_Class priority = scheduler_thread_class();
+    int replaying = capture_mode() == Capture_Mode_Replay;
+
+    for(int attempt = 1; attempt <= HTTP_MAX_ATTEMPTS; attempt++) {
+        if(attempt > 1)
+            http_sleep_ms(http_backoff_ms(attempt - 1));
+
+        if(endpoint_acquire(url, target, sizeof(target)) != 0) {
+            fprintf(stderr, "No upstream for %s is available, failing fast\n", url);
+            return NULL;
+        }
+        if(!replaying)
+            scheduler_admit(priority);
+
+        CURLcode res = CURLE_OK;
+        long code = 0;
+        double started_at = http_now_ms();
+        char *data = http_fetch_once(url, target, &res, &code);
+        double elapsed = http_now_ms() - started_at;
+        if(!replaying)
+            scheduler_finish(priority, elapsed, http_is_healthy(res, code));
+        endpoint_report(target, elapsed, http_is_healthy(res, code));
+
+        if(data != NULL)
+            return data;
+        if(!http_is_retryable(res, code))
+            break;
+    }
+
+    return NULL;
+}
+
+// Returns 0 when the transfer is running, -1 when it failed, or the number of
+// milliseconds to wait when the scheduler has no slot or token for it yet
+static int http_transfer_start(CURLM *multi, HttpTransfer *transfer) {
+    if(transfer->attempts == 0) {
+        if(transfer->request->url != NULL)
+            snprintf(transfer->url, sizeof(transfer->url), "%s", transfer->request->url);
+        else if(http_build_url(transfer->url, sizeof(transfer->url), transfer->request->latitude, transfer->request->longitude) < 0)
+            return -1;
+    }
+
+    // An open circuit fails fast before a slot or token is spent on it
+    if(!endpoint_available(transfer->url)) {
+        fprintf(stderr, "No upstream for %s is available, failing fast\n", transfer->url);
+        return -1;
+    }
+
+    // No slot or token: report how long to wait instead of blocking the other transfers
+    long long wait = scheduler_try_admit(transfer->priority);
+    if(wait > 0)
+        return (int)(wait / 1000000) + 1;
+
+    if(endpoint_acquire(transfer->url, transfer->target, sizeof(transfer->target)) != 0) {
+        fprintf(stderr, "No upstream for %s is available, failing fast\n", transfer->url);
+        scheduler_release(transfer->priority);
+        return -1;
+    }
+    transfer->attempts++;
+
+    transfer->chunk.memory = buffer_acquire(buffer_size_hint(transfer->url));
+    transfer->chunk.size = 0;
+    transfer->handle = transfer->chunk.memory != NULL ? http_acquire_handle() : NULL;
+    if(transfer->handle == NULL) {
+        buffer_release(transfer->chunk.memory);
+        endpoint_release(transfer->target);
+        scheduler_release(transfer->priority);
+        return -1;
+    }
+    transfer->chunk.handle = transfer->handle;
+
+    curl_easy_setopt(transfer->handle, CURLOPT_URL, transfer->target);
+    curl_easy_setopt(transfer->handle, CURLOPT_WRITEFUNCTION, WriteMemoryCallback);
+    curl_easy_setopt(transfer->handle, CURLOPT_WRITEDATA, (void *)&transfer->chunk);
+    curl_easy_setopt(transfer->handle, CURLOPT_PRIVATE, (void *)transfer);
+    if(capture_mode() == Capture_Mode_Record) {
+        curl_easy_setopt(transfer->handle, CURLOPT_HEADERFUNCTION, capture_append);
+        curl_easy_setopt(transfer->handle, CURLOPT_HEADERDATA, (void *)&transfer->headers);
+    }
+
+    transfer->started_at = http_now_ms();
+    if(curl_multi_add_handle(multi, transfer->handle) != CURLM_OK) {
+        http_release_handle(transfer->handle);
+        buffer_release(transfer->chunk.memory);
+        endpoint_release(transfer->target);
+        scheduler_release(transfer->priority);
+        return -1;
+    }
+    return 0;
+}
+
+// Milliseconds until the earliest queued transfer may start, capped at one second.
+// Nothing starts before notBefore (set while the rate limiter is out of tokens).
+static int http_next_ready_ms(HttpTransfer **waiting, int count, double now, double notBefore) {
+    double next = now + 1000.0;
+    for(int i = 0; i < count; i++) {
+        double ready = waiting[i]->ready_at > notBefore ? waiting[i]->ready_at : notBefore;
+        if(ready < next)
+            next = ready;
+    }
+    return next > now ? (int)(next - now) : 0;
+}
+
+// One request of a replayed http_fetch_many
+typedef struct {
+    HttpRequest *request;
+    char *data;
+    double done_at; // recorded time of all its attempts together
+} HttpReplayed;
+
+static int http_compare_replayed(const void *a, const void *b) {
+    double x = ((const HttpReplayed *)a)->done_at, y = ((const HttpReplayed *)b)->done_at;
+    return (x > y) - (x < y);
+}
+
+// Replay counterpart of http_fetch_many. Recorded retries are replayed as retries (without the
+// backoff). With original timing every request starts at once and completes after its recorded
+// time, so the in-flight limit is not modelled; otherwise they complete in request order.
+static int http_replay_many(HttpRequest* requests, int count, HttpCompleteCallback callback, void* context) {
+    HttpReplayed *replayed = calloc(count, sizeof(HttpReplayed));
+    if(replayed == NULL)
+        return -2;
+
+    for(int i = 0; i < count; i++) {
+        char url[HTTP_MAX_URL_LENGTH];
+        replayed[i].request = &requests[i];
+        if(requests[i].url != NULL)
+            snprintf(url, sizeof(url), "%s", requests[i].url);
+        else if(http_build_url(url, sizeof(url), requests[i].latitude, requests[i].longitude) < 0)
+            continue;
+
+        for(int attempt = 1; attempt <= HTTP_MAX_ATTEMPTS; attempt++) {
+            const CaptureEntry *entry = capture_find(url);
+            if(entry == NULL) {
+                fprintf(stderr, "No recorded response for %s\n", url);
+                break;
+            }
+
+            replayed[i].done_at += entry->elapsed_ms;
+            if(entry->result == CURLE_OK && entry->status == 200 && entry->body != NULL) {
+                replayed[i].data = buffer_copy(entry->body, entry->body_size);
+                break;
+            }
+            if(!http_is_retryable((CURLcode)entry->result, entry->status))
+                break;
+        }
+    }
+
+    int failed = 0;
+    double start = http_now_ms();
+    if(capture_timing())
+        qsort(replayed, count, sizeof(HttpReplayed), http_compare_replayed);
+
+    for(int i = 0; i < count; i++) {
+        if(capture_timing()) {
+            double wait = start + replayed[i].done_at - http_now_ms();
+            if(wait > 0)
+                http_sleep_ms((long)wait);
+        }
+
+        if(replayed[i].data == NULL)
+            failed++;
+        callback(replayed[i].request, replayed[i].data, context);
+    }
+
+    free(replayed);
+    return failed;
+}
+
+int http_fetch_many(HttpRequest* requests, int count, int maxInFlight, HttpCompleteCallback callback, void* context) {
+    if(requests == NULL || count <= 0 || callback == NULL)
+        return -1;
+
+    if(capture_mode() == Capture_Mode_Replay)
+        return http_replay_many(requests, count, callback, context);
+
+    if(maxInFlight <= 0)
+        maxInFlight = count; // the scheduler holds it to the adaptive limit
+
+    CURLM *multi = curl_multi_init();
+    if(multi == NULL)
+        return -2;
+    http_configure_multi(multi);
+
+    HttpTransfer *transfers = calloc(count, sizeof(HttpTransfer));
+    HttpTransfer **waiting = malloc(count * sizeof(HttpTransfer *));
+    if(transfers == NULL || waiting == NULL) {
+        free(transfers);
+        free(waiting);
+        curl_multi_cleanup(multi);
+        return -2;
+    }
+
+    // Transfers not currently running: new ones in request order, then retries waiting out their backoff
+    Scheduler_Class priority = scheduler_thread_class();
+    for(int i = 0; i < count; i++) {
+        transfers[i].request = &requests[i];
+        transfers[i].priority = priority;
+        waiting[i] = &transfers[i];
+    }
+    int waiting_count = count;
+
+    int in_flight = 0;
+    int failed = 0;
+    double throttled_until = 0;
+    while(waiting_count > 0 || in_flight > 0) {
+        // Top up to the in-flight limit with whatever is ready to start
+        double now = http_now_ms();
+        for(int i = 0; i < waiting_count && in_flight < maxInFlight && throttled_until <= now; ) {
+            HttpTransfer *transfer = waiting[i];
+            if(transfer->ready_at > now) {
+                i++;
+                continue;
+            }
+
+            int started = http_transfer_start(multi, transfer);
+            if(started > 0) {
+                throttled_until = now + started; // stays queued, try again when a token is due
+                break;
+            }
+
+            memmove(&waiting[i], &waiting[i + 1], (waiting_count - i - 1) * sizeof(HttpTransfer *));
+            waiting_count--;
+
+            if(started == 0) {
+                in_flight++;
+            } else {
+                failed++;
+                callback(transfer->request, NULL, context);
+            }
+        }
+
+        int running = 0;
+        curl_multi_perform(multi, &running);
+
+        // Hand every finished transfer to the callback right away
+        CURLMsg *msg;
+        int left = 0;
+        while((msg = curl_multi_info_read(multi, &left)) != NULL) {
+            if(msg->msg != CURLMSG_DONE)
+                continue;
+
+            CURL *curl_handle = msg->easy_handle;
+            CURLcode res = msg->data.result;
+            long code = 0;
+            HttpTransfer *transfer = NULL;
+            curl_easy_getinfo(curl_handle, CURLINFO_PRIVATE, (char **)&transfer);
+            curl_easy_getinfo(curl_handle, CURLINFO_RESPONSE_CODE, &code);
+
+            curl_multi_remove_handle(multi, curl_handle);
+            http_release_handle(curl_handle);
+            double elapsed = http_now_ms() - transfer->started_at;
+            scheduler_finish(transfer->priority, elapsed, http_is_healthy(res, code));
+            endpoint_report(transfer->target, elapsed, http_is_healthy(res, code));
+            in_flight--;
+
+            if(capture_mode() == Capture_Mode_Record) {
+                capture_record(transfer->url, res, code, http_now_ms() - transfer->started_at,
+                               transfer->headers.data, transfer->chunk.memory, transfer->chunk.size);
+                capture_buffer_free(&transfer->headers);
+            }
+
+            if(res == CURLE_OK && code == 200) {
+                buffer_record_size(transfer->url, transfer->chunk.size);
+                callback(transfer->request, transfer->chunk.memory, context);
+                continue;
+            }
+
+            if(res != CURLE_OK)
+                fprintf(stderr, "Transfer of %s failed: %s\n", transfer->target, curl_easy_strerror(res));
+            else
+                fprintf(stderr, "Transfer of %s failed: HTTP %ld\n", transfer->target, code);
+            buffer_release(transfer->chunk.memory);
+            transfer->chunk.memory = NULL;
+
+            if(http_is_retryable(res, code) && transfer->attempts < HTTP_MAX_ATTEMPTS) {
+                transfer->ready_at = http_now_ms() + http_backoff_ms(transfer->attempts);
+                waiting[waiting_count++] = transfer;
+            } else {
+                failed++;
+                callback(transfer->request, NULL, context);
+            }
+        }
+
+        int timeout = http_next_ready_ms(waiting, waiting_count, http_now_ms(), throttled_until);
+        if(in_flight > 0)
+            curl_multi_poll(multi, NULL, 0, timeout, NULL);
+        else if(waiting_count > 0)
+            http_sleep_ms(timeout);
+    }
+
+    free(waiting);
+    free(transfers);
+    curl_multi_cleanup(multi);
+    return failed;
+}
+
+json_t* http_fetch_json(double latitude, double longitude, json_error_t* error) {
+    char url[HTTP_MAX_URL_LENGTH];
+    if(http_build_url(url, sizeof(url), latitude, longitude) < 0)
+        return NULL;
+    return http_fetch_json_url(url, error);
+}
+
+json_t* http_fetch_json_url(const char* url, json_error_t* error) {
+    return http_fetch_json_conditional(url, NULL, NULL, error);
+}
+
+static json_t* http_fetch_json_replay(const char* url, HttpValidators* validators, CURLcode* res, long* status, json_error_t* error) {
+    const CaptureEntry *entry = http_replay_lookup(url, res, status);
+    if(entry == NULL || *res != CURLE_OK || *status != 200 || entry->body == NULL)
+        return NULL; // a recorded 304 included
+
+    json_t *root = json_loadb(entry->body, entry->body_size, 0, error);
+    if(root != NULL && validators != NULL)
+        http_replay_validators(entry->headers, validators);
+    return root;
+}
+
+static json_t* http_fetch_json_once(const char* url, const char* target, HttpValidators* validators, CURLcode* res, long* status, json_error_t* error) {
+    if(capture_mode() == Capture_Mode_Replay)
+        return http_fetch_json_replay(url, validators, res, status, error);
+
+    // The stream state is a large block per fetch, so it comes from the buffer pool as well
+    HttpStream *stream = (HttpStream *)buffer_acquire(sizeof(HttpStream));
+    if(stream == NULL)
+        return NULL;
+    memset(stream, 0, sizeof(HttpStream));
+
+    struct curl_slist *headers = NULL;
+    if(validators != NULL) {
+        char header[256];
+        if(validators->etag[0] != '\0') {
+            snprintf(header, sizeof(header), "If-None-Match: %s", validators->etag);
+            headers = curl_slist_append(headers, header);
+        }
+        if(validators->last_modified[0] != '\0') {
+            snprintf(header, sizeof(header), "If-Modified-Since: %s", validators->last_modified);
+            headers = curl_slist_append(headers, header);
+        }
+    }
+
+    HttpRace *race = &stream->race;
+    if(http_race_start(race, url, target, headers, StreamWriteCallback, (void *)stream) != 0) {
+        curl_slist_free_all(headers);
+        buffer_release((char *)stream);
+        return NULL;
+    }
+
+    json_t *root = json_load_callback(StreamReadCallback, stream, 0, error);
+
+    long code = 0;
+    curl_easy_getinfo(http_race_handle(race), CURLINFO_RESPONSE_CODE, &code);
+    *status = code;
+    *res = race->result;
+    http_race_record(race, code, stream->body.data, stream->body.size);
+
+    if(race->done && race->result == CURLE_OK && code == 304) {
+        json_decref(root); // nothing to parse, the cached entry is still current
+        root = NULL;
+    } else if(!race->done || race->result != CURLE_OK || code != 200) {
+        if(!race->done)
+            fprintf(stderr, "Transfer of %s aborted: invalid JSON\n", target);
+        else if(race->result != CURLE_OK)
+            fprintf(stderr, "Transfer of %s failed: %s\n", target, curl_easy_strerror(race->result));
+        else
+            fprintf(stderr, "Transfer of %s failed: HTTP %ld\n", target, code);
+        json_decref(root);
+        root = NULL;
+    } else if(validators != NULL) {
+        *validators = race->winner->received;
+    }
+
+    http_race_finish(race);
+    capture_buffer_free(&stream->body);
+    curl_slist_free_all(headers);
+    buffer_release((char *)stream);
+    return root;
+}
+
+json_t* http_fetch_json_conditional(const char* url, HttpValidators* validators, long* status, json_error_t* error) {
+    char target[HTTP_MAX_URL_LENGTH];
+    Scheduler_Class priority = scheduler_thread_class();
+    int replaying = capture_mode() == Capture_Mode_Replay;
+
+    if(status != NULL)
+        *status = 0;
+
+    for(int attempt = 1; attempt <= HTTP_MAX_ATTEMPTS; attempt++) {
+        if(attempt > 1)
+            http_sleep_ms(http_backoff_ms(attempt - 1));
+
+        if(endpoint_acquire(url, target, sizeof(target)) != 0) {
+            fprintf(stderr, "No upstream for %s is available, failing fast\n", url);
+            return NULL;
+        }
+        if(!replaying)
+            scheduler_admit(priority);
+
+        CURLcode res = CURLE_OK;
+        long code = 0;
+        double started_at = http_now_ms();
+        json_t *root = http_fetch_json_once(url, target, validators, &res, &code, error);
+        double elapsed = http_now_ms() - started_at;
+        if(!replaying)
+            scheduler_finish(priority, elapsed, http_is_healthy(res, code));
+        endpoint_report(target, elapsed, http_is_healthy(res, code));
+
+        if(status != NULL)
+            *status = code;
+        if(root != NULL || code == 304)
+            return root;
+        if(!http_is_retryable(res, code))
+            break;
+    }
+
+    return NULL;
+}
+
+void http_free(char* data) {
+    buffer_release(data);
 }
 
 int http_cleanup() {
+    capture_close();
+    buffer_trim();
+
+    pthread_mutex_lock(&pool_lock);
+    while(pool_count > 0)
+        curl_easy_cleanup(pool[--pool_count]);
+    pthread_mutex_unlock(&pool_lock);
+
+    if(share != NULL) {
+        curl_share_cleanup(share);
+        share = NULL;
+        for(int i = 0; i < CURL_LOCK_DATA_LAST; i++)
+            pthread_mutex_destroy(&share_locks[i]);
+    }
+
+    curl_global_cleanup();
     return 0;
-}
\ No newline at end of file
+}
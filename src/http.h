@@ -1,5 +1,90 @@
+#ifndef Http_h__
+#define Http_h__
+
 #include <curl/curl.h>
+#include "jansson/jansson.h"
+#include "limit.h"
+
+// Retries: at most HTTP_MAX_ATTEMPTS tries, waiting a random time up to an exponentially growing, capped step
+#define HTTP_MAX_ATTEMPTS 3
+#define HTTP_BACKOFF_BASE_MS 200
+#define HTTP_BACKOFF_MAX_MS 2000
+
+// Longest URL the client will build; batched requests are split to stay below it
+#define HTTP_MAX_URL_LENGTH 2048
+
+typedef struct {
+    double latitude;
+    double longitude;
+    const char* url; // if set, fetched as-is instead of building a URL from the coordinates
+    void* userdata;
+} HttpRequest;
+
+// Called once per request as soon as its transfer finishes. data is NULL on failure,
+// otherwise the callback owns it and is responsible for releasing it with http_free.
+typedef void (*HttpCompleteCallback)(HttpRequest* request, char* data, void* context);
+
+// Cache validators from the last 200 response for a URL; empty strings when upstream sent none
+typedef struct {
+    char etag[128];
+    char last_modified[64];
+} HttpValidators;
 
 int http_init();
+void http_set_base_url(const char* baseUrl);
+// Equivalent upstreams; URLs are built against the first, and every attempt goes to the one
+// with the best recent latency whose circuit is closed (see endpoint.h)
+int http_set_endpoints(const char** baseUrls, int count);
+void http_set_ca_file(const char* caFile);
+// On (the default): HTTP/2 with concurrent transfers multiplexed over one connection per host.
+// Off: plain HTTP/1.1 keep-alive, one transfer per connection at a time.
+void http_set_multiplex(int enabled);
+// Upstream request budget shared by all fetches; requestsPerSecond <= 0 turns limiting off
+void http_set_rate_limit(double requestsPerSecond, int burst);
+// Share of the concurrency limit background work (bulk refreshes, see scheduler.h) may hold.
+// Interactive fetches are always admitted first.
+void http_set_scheduler(double backgroundShare);
+// Concurrent upstream transfers across all fetch paths. The limit starts at initial and adapts
+// to measured round trip times and failures within [min, max]; min == max keeps it fixed.
+void http_set_concurrency(int initial, int min, int max);
+int http_concurrency_limit();
+// Most recent changes of the limit, oldest first (see limit.h)
+int http_concurrency_history(LimitChange* changes, int capacity);
+// Single fetches that have not started responding within the given percentile of recent response
+// times send a duplicate and use whichever responds first. budget is hedges per request, at most 1,
+// so hedging never more than doubles upstream load. percentile <= 0 turns it off (the default).
+void http_set_hedging(double percentile, double budget);
+// Record mode appends every upstream attempt (URL, status, headers, body, timing) to an archive
+// file. Replay mode answers all fetches from such an archive without touching the network,
+// after the recorded delay if originalTiming is set. Both stay on until http_cleanup.
+int http_record(const char* archivePath);
+int http_replay(const char* archivePath, int originalTiming);
+int http_build_url(char* buffer, size_t size, double latitude, double longitude);
+// Builds one URL for several coordinates (comma separated lists, as the forecast API accepts).
+// Returns how many of the coordinates fit below size, or -1 if not even one does.
+int http_build_batch_url(char* buffer, size_t size, const double* latitudes, const double* longitudes, int count);
+// Response bodies come from a buffer pool; release them with http_free, not free
 char* http_fetch(double latitude, double longitude);
-int http_cleanup();
\ No newline at end of file
+char* http_fetch_url(const char* url);
+void http_free(char* data);
+// Streaming mode: the body is parsed chunk by chunk while it downloads, no full copy is kept.
+// Returns a new reference or NULL (error is filled in on parse/transfer failure).
+json_t* http_fetch_json(double latitude, double longitude, json_error_t* error);
+json_t* http_fetch_json_url(const char* url, json_error_t* error);
+// Conditional GET: sends If-None-Match/If-Modified-Since from validators and replaces them with
+// the ones in a 200 response. A 304 returns NULL with *status set to 304 and nothing parsed.
+json_t* http_fetch_json_conditional(const char* url, HttpValidators* validators, long* status, json_error_t* error);
+// maxInFlight caps this call on top of the shared concurrency limit; <= 0 leaves it to that limit
+int http_fetch_many(HttpRequest* requests, int count, int maxInFlight, HttpCompleteCallback callback, void* context);
+// Building blocks for other transports (see engine.c): multi handles and pooled easy handles
+// configured like the ones http_fetch uses, and the retry policy all fetch paths share.
+void http_configure_multi(CURLM* multi);
+CURL* http_acquire_handle();
+void http_release_handle(CURL* curl_handle);
+int http_is_retryable(CURLcode res, long code);
+int http_is_healthy(CURLcode res, long code);
+long http_backoff_ms(int attempt);
+
+int http_cleanup();
+
+#endif // Http_h__
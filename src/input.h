@@ -7,12 +7,13 @@ typedef enum {
     Input_Command_Error = -1,
     Input_Command_OK = 0,
     Input_Command_Exit = 1,
-    Input_Command_Invalid = 2
+    Input_Command_Invalid = 2,
+    Input_Command_Refresh = 3
 } Input_Command;
 
 static inline Input_Command input_select_city(char** cityName)
 {
-    printf("Enter city name (or 'exit' to quit): ");
+    printf("Enter city name ('refresh' to update all, 'exit' to quit): ");
     char buffer[256];
     if (fgets(buffer, sizeof(buffer), stdin) == NULL) {
         return Input_Command_Error;
@@ -23,6 +24,8 @@ static inline Input_Command input_select_city(char** cityName)
 
     if (strcmp(buffer, "exit") == 0) {
         return Input_Command_Exit;
+    } else if (strcmp(buffer, "refresh") == 0) {
+        return Input_Command_Refresh;
     } else if (strlen(buffer) == 0) {
         return Input_Command_Invalid;
     } else {
@@ -0,0 +1,175 @@
+#define _POSIX_C_SOURCE 200809L
+
+#include "limit.h"
+
+#include <time.h>
+#include <pthread.h>
+
+static double limit = LIMIT_DEFAULT_INITIAL;
+static int limit_min = LIMIT_DEFAULT_MIN;
+static int limit_max = LIMIT_DEFAULT_MAX;
+
+static double recent_rtt = 0; // 0 until the first sample
+static double base_rtt = 0;
+static int probe_countdown = LIMIT_PROBE_INTERVAL;
+static double probe_restore = 0; // the limit to return to after a probe, 0 when not probing
+static double probe_total = 0;
+static int probe_count = 0;
+
+static LimitChange history[LIMIT_HISTORY];
+static int history_count = 0;
+static int history_next = 0;
+
+static pthread_mutex_t limit_lock = PTHREAD_MUTEX_INITIALIZER;
+
+static double limit_now_ms() {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1000.0 + ts.tv_nsec / 1000000.0;
+}
+
+// How many transfers the upstream may queue without it counting as overload
+static int limit_headroom(int _Limit) {
+    int root = 1;
+    while((root + 1) * (root + 1) <= _Limit)
+        root++;
+    return root;
+}
+
+// Must be called with limit_lock held
+static void limit_record(int _InFlight, int _Dropped) {
+    LimitChange* change = &history[history_next];
+    change->at_ms = limit_now_ms();
+    change->limit = (int)limit;
+    change->recent_rtt_ms = recent_rtt;
+    change->base_rtt_ms = base_rtt;
+    change->in_flight = _InFlight;
+    change->dropped = _Dropped;
+    change->probing = probe_restore > 0;
+
+    history_next = (history_next + 1) % LIMIT_HISTORY;
+    if(history_count < LIMIT_HISTORY)
+        history_count++;
+}
+
+void limit_configure(int _Initial, int _Min, int _Max) {
+    if(_Min < 1)
+        _Min = 1;
+    if(_Max < _Min)
+        _Max = _Min;
+    if(_Initial < _Min)
+        _Initial = _Min;
+    if(_Initial > _Max)
+        _Initial = _Max;
+
+    pthread_mutex_lock(&limit_lock);
+    limit = _Initial;
+    limit_min = _Min;
+    limit_max = _Max;
+    recent_rtt = 0;
+    base_rtt = 0;
+    probe_countdown = LIMIT_PROBE_INTERVAL;
+    probe_restore = 0;
+    probe_total = 0;
+    probe_count = 0;
+    history_count = 0;
+    history_next = 0;
+    limit_record(0, 0);
+    pthread_mutex_unlock(&limit_lock);
+}
+
+int limit_current() {
+    pthread_mutex_lock(&limit_lock);
+    int current = (int)limit;
+    pthread_mutex_unlock(&limit_lock);
+    return current;
+}
+
+// Must be called with limit_lock held. Returns 1 while the sample belongs to a probe.
+static int limit_probe(double _RttMs, int _InFlight, int _Dropped) {
+    if(probe_restore <= 0) {
+        if(--probe_countdown > 0 || limit_min == limit_max)
+            return 0;
+
+        probe_countdown = LIMIT_PROBE_INTERVAL;
+        probe_restore = limit;
+        limit = limit_min;
+        limit_record(_InFlight, _Dropped);
+        return 1;
+    }
+
+    // Transfers started before the probe still finish with queued round trips; only count the
+    // ones that ran with no more company than the minimum allows
+    if(_Dropped || _RttMs <= 0 || _InFlight > limit_min)
+        return 1;
+
+    probe_total += _RttMs;
+    if(++probe_count < LIMIT_PROBE_SAMPLES)
+        return 1;
+
+    base_rtt = probe_total / probe_count;
+    recent_rtt = base_rtt;
+    limit = probe_restore;
+    probe_restore = 0;
+    probe_total = 0;
+    probe_count = 0;
+    limit_record(_InFlight, _Dropped);
+    return 1;
+}
+
+void limit_sample(double _RttMs, int _InFlight, int _Dropped) {
+    pthread_mutex_lock(&limit_lock);
+    if(limit_probe(_RttMs, _InFlight, _Dropped)) {
+        pthread_mutex_unlock(&limit_lock);
+        return;
+    }
+
+    int before = (int)limit;
+    if(_Dropped) {
+        limit *= LIMIT_BACKOFF;
+    } else if(_RttMs > 0) {
+        if(recent_rtt <= 0) {
+            recent_rtt = _RttMs;
+            base_rtt = _RttMs;
+        } else {
+            recent_rtt += (_RttMs - recent_rtt) * 2.0 / (LIMIT_RECENT_WINDOW + 1);
+            base_rtt += (_RttMs - base_rtt) * 2.0 / (LIMIT_BASE_WINDOW + 1);
+        }
+
+        // With most of the limit unused, the round trip time says nothing about the limit
+        if(_InFlight * 2 >= before) {
+            double gradient = LIMIT_TOLERANCE * base_rtt / recent_rtt;
+            if(gradient < 0.5)
+                gradient = 0.5;
+            if(gradient > 1.0)
+                gradient = 1.0;
+
+            double estimate = limit * gradient + limit_headroom(before);
+            limit = limit * (1 - LIMIT_SMOOTHING) + estimate * LIMIT_SMOOTHING;
+        }
+    }
+
+    if(limit < limit_min)
+        limit = limit_min;
+    if(limit > limit_max)
+        limit = limit_max;
+
+    if((int)limit != before)
+        limit_record(_InFlight, _Dropped);
+    pthread_mutex_unlock(&limit_lock);
+}
+
+int limit_history(LimitChange* _Changes, int _Capacity) {
+    if(_Changes == NULL || _Capacity <= 0)
+        return 0;
+
+    pthread_mutex_lock(&limit_lock);
+    int count = history_count < _Capacity ? history_count : _Capacity;
+    for(int i = 0; i < count; i++) {
+        int index = (history_next - count + i + LIMIT_HISTORY) % LIMIT_HISTORY;
+        _Changes[i] = history[index];
+    }
+    pthread_mutex_unlock(&limit_lock);
+
+    return count;
+}
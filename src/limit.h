@@ -0,0 +1,52 @@
+#ifndef Limit_h__
+#define Limit_h__
+
+/*
+ * Adaptive limit on concurrent upstream transfers. Every finished attempt reports its round
+ * trip time, kept as a recent and a long (baseline) moving average. While the recent average
+ * stays within LIMIT_TOLERANCE of the baseline the upstream is not queueing, and the limit grows
+ * by about its square root. Beyond that it shrinks in proportion (the gradient). Failed
+ * attempts (transport errors, 5xx, 429) cut it multiplicatively at once.
+ *
+ * Under sustained load the baseline would slowly absorb the queueing and let the limit creep
+ * up. So every LIMIT_PROBE_INTERVAL samples the limit drops to its minimum, and the average of
+ * the next LIMIT_PROBE_SAMPLES transfers that run without company becomes the new baseline.
+ */
+
+#define LIMIT_DEFAULT_INITIAL 8
+#define LIMIT_DEFAULT_MIN 2
+#define LIMIT_DEFAULT_MAX 32
+
+#define LIMIT_RECENT_WINDOW 10 // samples in the recent average
+#define LIMIT_BASE_WINDOW 5000 // samples in the baseline average
+#define LIMIT_TOLERANCE 1.5 // how far above the baseline the recent average may be without shrinking
+#define LIMIT_PROBE_INTERVAL 1000 // samples between baseline probes
+#define LIMIT_PROBE_SAMPLES 5
+#define LIMIT_SMOOTHING 0.2 // weight of a new estimate against the current limit
+#define LIMIT_BACKOFF 0.9 // factor applied on a failed attempt
+#define LIMIT_HISTORY 256 // changes kept for limit_history
+
+// One change of the limit and what it was based on
+typedef struct {
+    double at_ms; // monotonic clock
+    int limit;
+    double recent_rtt_ms;
+    double base_rtt_ms;
+    int in_flight;
+    int dropped; // the change was a backoff after a failed attempt
+    int probing; // the limit is at its minimum to measure the baseline
+} LimitChange;
+
+// Starts over at _Initial, adapting within [_Min, _Max]. _Min == _Max gives a static limit.
+void limit_configure(int _Initial, int _Min, int _Max);
+
+int limit_current();
+
+// One finished attempt: its round trip time, the transfers in flight when it finished
+// (itself included), and whether it failed
+void limit_sample(double _RttMs, int _InFlight, int _Dropped);
+
+// Copies up to _Capacity of the most recent changes, oldest first; returns how many
+int limit_history(LimitChange* _Changes, int _Capacity);
+
+#endif // Limit_h__
@@ -0,0 +1,245 @@
+#define _POSIX_C_SOURCE 200809L
+
+#include "prefetch.h"
+
+#include <stdlib.h>
+#include <string.h>
+#include <pthread.h>
+
+#include "refresh.h"
+#include "scheduler.h"
+#include "weather.h"
+#include "capture.h"
+
+typedef struct {
+    time_t due;
+    City* city;
+} PrefetchTimer;
+
+static PrefetchTimer* heap = NULL;
+static int heap_count = 0;
+static int heap_capacity = 0;
+
+static pthread_t prefetch_thread;
+static int running = 0;
+static unsigned long refreshes = 0;
+static unsigned long failures = 0;
+static pthread_mutex_t prefetch_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t prefetch_wake = PTHREAD_COND_INITIALIZER;
+
+// Must be called with prefetch_lock held. Files _Timer at _Index or above it, for a new
+// timer or one whose due time moved earlier.
+static void prefetch_sift_up(int _Index, PrefetchTimer _Timer) {
+    int index = _Index;
+    while(index > 0) {
+        int parent = (index - 1) / 2;
+        if(heap[parent].due <= _Timer.due)
+            break;
+
+        heap[index] = heap[parent];
+        index = parent;
+    }
+
+    heap[index] = _Timer;
+}
+
+// Must be called with prefetch_lock held
+static void prefetch_push(City* _City, time_t _Due) {
+    PrefetchTimer timer = { _Due, _City };
+    prefetch_sift_up(heap_count++, timer);
+}
+
+// Must be called with prefetch_lock held and the heap not empty
+static PrefetchTimer prefetch_pop() {
+    PrefetchTimer top = heap[0];
+    PrefetchTimer last = heap[--heap_count];
+
+    int index = 0;
+    for(;;) {
+        int child = index * 2 + 1;
+        if(child >= heap_count)
+            break;
+        if(child + 1 < heap_count && heap[child + 1].due < heap[child].due)
+            child++;
+        if(last.due <= heap[child].due)
+            break;
+
+        heap[index] = heap[child];
+        index = child;
+    }
+
+    if(heap_count > 0)
+        heap[index] = last;
+    return top;
+}
+
+// Where in the window before expiry this city is refreshed
+static time_t prefetch_offset(const char* _Name) {
+    unsigned int hash = 2166136261u;
+    for(const unsigned char* ptr = (const unsigned char*)_Name; *ptr != '\0'; ptr++)
+        hash = (hash ^ *ptr) * 16777619u;
+
+    return (time_t)(hash % PREFETCH_LEAD_S);
+}
+
+static time_t prefetch_due(City* _City, time_t _Now) {
+    time_t expiry = weather_expiry(_City->name);
+    if(expiry == 0)
+        return _Now + PREFETCH_RESCAN_S;
+
+    return expiry - PREFETCH_LEAD_S + prefetch_offset(_City->name);
+}
+
+static void prefetch_deadline(struct timespec* _Deadline, long _Ms) {
+    clock_gettime(CLOCK_REALTIME, _Deadline);
+    _Deadline->tv_sec += _Ms / 1000;
+    _Deadline->tv_nsec += (_Ms % 1000) * 1000000L;
+    if(_Deadline->tv_nsec >= 1000000000L) {
+        _Deadline->tv_sec++;
+        _Deadline->tv_nsec -= 1000000000L;
+    }
+}
+
+static void* prefetch_run(void* _Arg) {
+    (void)_Arg;
+    scheduler_set_thread_class(Scheduler_Class_Background);
+
+    pthread_mutex_lock(&prefetch_lock);
+    while(running) {
+        time_t now = time(NULL);
+        if(heap_count == 0 || heap[0].due > now) {
+            struct timespec deadline = { heap_count > 0 ? heap[0].due : now + PREFETCH_RESCAN_S, 0 };
+            pthread_cond_timedwait(&prefetch_wake, &prefetch_lock, &deadline);
+            continue;
+        }
+
+        PrefetchTimer timer = prefetch_pop();
+        pthread_mutex_unlock(&prefetch_lock);
+
+        // A lookup may have refreshed it (or it may have left the cache) since it was filed
+        time_t due = prefetch_due(timer.city, now);
+        int refreshed = 0;
+        int failed = 0;
+        if(due <= now && weather_expiry(timer.city->name) != 0) {
+            refreshed = 1;
+            failed = refresh_city(timer.city, NULL) != 0;
+            due = failed ? now + PREFETCH_RETRY_S : prefetch_due(timer.city, now);
+
+            // Nothing new came back (the expiry did not move), so try again later
+            if(due <= now)
+                due = now + PREFETCH_RETRY_S;
+        }
+
+        pthread_mutex_lock(&prefetch_lock);
+        refreshes += refreshed;
+        failures += failed;
+        prefetch_push(timer.city, due);
+
+        if(refreshed && running) {
+            struct timespec deadline;
+            prefetch_deadline(&deadline, PREFETCH_GAP_MS);
+            while(running && pthread_cond_timedwait(&prefetch_wake, &prefetch_lock, &deadline) == 0)
+                ;
+        }
+    }
+    pthread_mutex_unlock(&prefetch_lock);
+
+    return NULL;
+}
+
+int prefetch_start(Cities* _Cities) {
+    // Refreshes at wall-clock times would make a replay depend on when it runs, and would mix
+    // requests nobody asked for into a recording
+    if(_Cities == NULL || capture_mode() != Capture_Mode_Off)
+        return -1;
+
+    pthread_mutex_lock(&prefetch_lock);
+    if(running) {
+        pthread_mutex_unlock(&prefetch_lock);
+        return -1;
+    }
+
+    int count = _Cities->list.length;
+    PrefetchTimer* timers = (PrefetchTimer*)realloc(heap, sizeof(PrefetchTimer) * (count > 0 ? count : 1));
+    if(timers == NULL) {
+        pthread_mutex_unlock(&prefetch_lock);
+        return -1;
+    }
+    heap = timers;
+    heap_capacity = count;
+    heap_count = 0;
+
+    time_t now = time(NULL);
+    City* city = NULL;
+    LinkedList_ForEach(&_Cities->list, &city) {
+        if(heap_count < heap_capacity)
+            prefetch_push(city, prefetch_due(city, now));
+    }
+
+    running = 1;
+    if(pthread_create(&prefetch_thread, NULL, prefetch_run, NULL) != 0) {
+        running = 0;
+        pthread_mutex_unlock(&prefetch_lock);
+        return -1;
+    }
+    pthread_mutex_unlock(&prefetch_lock);
+
+    return 0;
+}
+
+void prefetch_stop() {
+    pthread_mutex_lock(&prefetch_lock);
+    if(!running) {
+        pthread_mutex_unlock(&prefetch_lock);
+        return;
+    }
+    running = 0;
+    pthread_cond_broadcast(&prefetch_wake);
+    pthread_mutex_unlock(&prefetch_lock);
+
+    pthread_join(prefetch_thread, NULL);
+
+    pthread_mutex_lock(&prefetch_lock);
+    free(heap);
+    heap = NULL;
+    heap_count = 0;
+    heap_capacity = 0;
+    pthread_mutex_unlock(&prefetch_lock);
+}
+
+int prefetch_request(City* _City) {
+    if(_City == NULL)
+        return -1;
+
+    pthread_mutex_lock(&prefetch_lock);
+    if(!running) {
+        pthread_mutex_unlock(&prefetch_lock);
+        return -1;
+    }
+
+    // Not in the heap means the thread is refreshing it right now
+    for(int i = 0; i < heap_count; i++) {
+        if(heap[i].city != _City)
+            continue;
+
+        PrefetchTimer timer = heap[i];
+        if(timer.due > time(NULL)) {
+            timer.due = time(NULL);
+            prefetch_sift_up(i, timer);
+            pthread_cond_broadcast(&prefetch_wake);
+        }
+        break;
+    }
+    pthread_mutex_unlock(&prefetch_lock);
+
+    return 0;
+}
+
+void prefetch_stats(unsigned long* _Refreshes, unsigned long* _Failures) {
+    pthread_mutex_lock(&prefetch_lock);
+    if(_Refreshes != NULL)
+        *(_Refreshes) = refreshes;
+    if(_Failures != NULL)
+        *(_Failures) = failures;
+    pthread_mutex_unlock(&prefetch_lock);
+}
@@ -0,0 +1,38 @@
+#ifndef Prefetch_h__
+#define Prefetch_h__
+
+#include <time.h>
+
+#include "cities.h"
+
+/*
+ * Refreshes cached cities ahead of their expiry on a background thread, so lookups find them
+ * fresh instead of discovering staleness themselves. Every city sits in a min-heap ordered by
+ * when it is due: a point in the PREFETCH_LEAD_S before its expiry that is fixed per city, so
+ * cities that expire together (upstream updates them all on the same quarter hour) spread out
+ * over that window. The thread pops due cities one at a time, PREFETCH_GAP_MS apart, hands
+ * them to refresh_city as background work and files them again by their new expiry.
+ *
+ * Cities without a cache entry are not fetched; they are looked at again every
+ * PREFETCH_RESCAN_S and picked up once a lookup or bulk refresh has cached them.
+ */
+
+#define PREFETCH_LEAD_S 60
+#define PREFETCH_GAP_MS 100 // between two refreshes started by the thread
+#define PREFETCH_RESCAN_S 30 // for cities that are not cached
+#define PREFETCH_RETRY_S 60 // after a refresh that failed
+
+// Starts the thread for every city in _Cities (which must outlive it). Returns 0, or -1 if
+// it could not be started, is already running, or traffic is being recorded or replayed
+// (capture.h), where only what the user asks for may reach upstream.
+int prefetch_start(Cities* _Cities);
+void prefetch_stop();
+
+// Moves _City to the front of the queue, for a lookup that shows its stale entry meanwhile.
+// Returns 0, or -1 if the thread is not running and the caller has to refresh it itself.
+int prefetch_request(City* _City);
+
+// Refreshes started and failed by the thread
+void prefetch_stats(unsigned long* _Refreshes, unsigned long* _Failures);
+
+#endif // Prefetch_h__
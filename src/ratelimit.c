@@ -0,0 +1,72 @@
+#define _POSIX_C_SOURCE 200809L
+
+#include "ratelimit.h"
+
+#include <time.h>
+
+#define NS_PER_SECOND 1000000000LL
+
+// Nanoseconds between tokens and how far ahead of now the arrival time may run (burst)
+static long long interval_ns = (long long)(NS_PER_SECOND / RATELIMIT_DEFAULT_RATE);
+static long long tolerance_ns = (long long)(NS_PER_SECOND / RATELIMIT_DEFAULT_RATE) * RATELIMIT_DEFAULT_BURST;
+static long long arrival_ns = 0;
+
+static long long ratelimit_now() {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * NS_PER_SECOND + ts.tv_nsec;
+}
+
+void ratelimit_configure(double _Rate, int _Burst) {
+    long long interval = _Rate > 0 ? (long long)(NS_PER_SECOND / _Rate) : 0;
+    if(_Burst < 1)
+        _Burst = 1;
+
+    __atomic_store_n(&tolerance_ns, interval * _Burst, __ATOMIC_RELAXED);
+    __atomic_store_n(&interval_ns, interval, __ATOMIC_RELEASE);
+    __atomic_store_n(&arrival_ns, 0, __ATOMIC_RELEASE); // start over with a full bucket
+}
+
+long long ratelimit_try_acquire() {
+    return ratelimit_try_acquire_reserve(0);
+}
+
+long long ratelimit_try_acquire_reserve(int _Reserve) {
+    long long interval = __atomic_load_n(&interval_ns, __ATOMIC_ACQUIRE);
+    if(interval <= 0)
+        return 0;
+
+    // Keeping _Reserve tokens back is the same as a bucket that many tokens smaller
+    long long tolerance = __atomic_load_n(&tolerance_ns, __ATOMIC_RELAXED);
+    if(_Reserve > 0) {
+        tolerance -= interval * _Reserve;
+        if(tolerance < interval)
+            tolerance = interval;
+    }
+    long long now = ratelimit_now();
+    long long arrival = __atomic_load_n(&arrival_ns, __ATOMIC_RELAXED);
+
+    while(1) {
+        long long next = (arrival > now ? arrival : now) + interval;
+        if(next - now > tolerance)
+            return next - now - tolerance; // would exceed; nothing taken
+
+        if(__atomic_compare_exchange_n(&arrival_ns, &arrival, next, 1, __ATOMIC_ACQ_REL, __ATOMIC_RELAXED))
+            return 0;
+        // arrival now holds the value another thread stored; try again against it
+    }
+}
+
+void ratelimit_acquire() {
+    ratelimit_acquire_reserve(0);
+}
+
+void ratelimit_acquire_reserve(int _Reserve) {
+    long long wait;
+    while((wait = ratelimit_try_acquire_reserve(_Reserve)) > 0) {
+        struct timespec ts;
+        ts.tv_sec = wait / NS_PER_SECOND;
+        ts.tv_nsec = wait % NS_PER_SECOND;
+        nanosleep(&ts, NULL);
+    }
+}
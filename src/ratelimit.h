@@ -0,0 +1,29 @@
+#ifndef Ratelimit_h__
+#define Ratelimit_h__
+
+/*
+ * Process-wide token bucket for upstream requests, shared by every thread and fetch path.
+ * Implemented as GCRA: the whole bucket is one 64-bit "theoretical arrival time" advanced
+ * with compare-and-swap, so taking a token never locks.
+ */
+
+// Open-Meteo's free tier allows 600 calls per minute
+#define RATELIMIT_DEFAULT_RATE 10.0
+#define RATELIMIT_DEFAULT_BURST 10
+
+// _Rate is tokens per second, _Burst the bucket size. A rate <= 0 disables limiting.
+void ratelimit_configure(double _Rate, int _Burst);
+
+// Takes a token if one is available and returns 0. Otherwise takes nothing and returns the
+// number of nanoseconds until a token will be available, for callers that wait on their own.
+long long ratelimit_try_acquire();
+
+// Blocks until a token has been taken
+void ratelimit_acquire();
+
+// Variants that only take a token while at least _Reserve more would be left in the bucket,
+// so lower-priority callers cannot drain it. The reserve is capped at the burst size minus one.
+long long ratelimit_try_acquire_reserve(int _Reserve);
+void ratelimit_acquire_reserve(int _Reserve);
+
+#endif // Ratelimit_h__
@@ -0,0 +1,147 @@
+#define _XOPEN_SOURCE 700
+#define _GNU_SOURCE
+
+#include "record.h"
+
+#include <stdio.h>
+#include <string.h>
+
+static const char* field_names[Record_Field_Count] = {
+    "temperature_2m", "relative_humidity_2m", "apparent_temperature", "is_day", "precipitation",
+    "rain", "showers", "snowfall", "weather_code", "cloud_cover", "pressure_msl", "surface_pressure",
+    "wind_speed_10m", "wind_direction_10m", "wind_gusts_10m"
+};
+
+// Upstream sends these as integers
+static const int field_integer[Record_Field_Count] = {
+    0, 1, 0, 1, 0, 0, 0, 0, 1, 1, 0, 0, 0, 1, 0
+};
+
+const char* record_field_name(Record_Field _Field) {
+    if((int)_Field < 0 || _Field >= Record_Field_Count)
+        return NULL;
+
+    return field_names[_Field];
+}
+
+int record_from_json(json_t* _Root, Record* _Record) {
+    if(_Record == NULL)
+        return -1;
+
+    memset(_Record, 0, sizeof(Record));
+
+    json_t* current = json_object_get(_Root, "current");
+    if(!json_is_object(current))
+        return -1;
+
+    json_t* time_val = json_object_get(current, "time");
+    if(json_is_string(time_val)) {
+        snprintf(_Record->time, sizeof(_Record->time), "%s", json_string_value(time_val));
+
+        struct tm tm_time = {0};
+        if(strptime(_Record->time, "%Y-%m-%dT%H:%M", &tm_time) != NULL)
+            _Record->observed = timegm(&tm_time);
+        else
+            fprintf(stderr, "Failed to parse time string: %s\n", _Record->time);
+    }
+
+    json_t* interval_val = json_object_get(current, "interval");
+    if(json_is_integer(interval_val))
+        _Record->interval = (int)json_integer_value(interval_val);
+
+    for(int i = 0; i < Record_Field_Count; i++) {
+        json_t* value = json_object_get(current, field_names[i]);
+        if(!json_is_number(value))
+            continue;
+
+        _Record->values[i] = json_number_value(value);
+        _Record->present |= 1u << i;
+    }
+
+    return 0;
+}
+
+json_t* record_to_json(const Record* _Record) {
+    if(_Record == NULL)
+        return NULL;
+
+    json_t* current = json_object();
+    if(_Record->time[0] != '\0')
+        json_object_set_new(current, "time", json_string(_Record->time));
+    if(_Record->interval > 0)
+        json_object_set_new(current, "interval", json_integer(_Record->interval));
+
+    for(int i = 0; i < Record_Field_Count; i++) {
+        if(!(_Record->present & (1u << i)))
+            continue;
+
+        json_t* value = field_integer[i] ? json_integer((json_int_t)_Record->values[i]) : json_real(_Record->values[i]);
+        json_object_set_new(current, field_names[i], value);
+    }
+
+    json_t* root = json_object();
+    json_object_set_new(root, "current", current);
+    return root;
+}
+
+void record_encode(const Record* _Record, uint32_t _JsonLength, RecordFile* _File) {
+    memset(_File, 0, sizeof(RecordFile));
+    _File->magic = RECORD_MAGIC;
+    _File->version = RECORD_VERSION;
+    _File->header_size = sizeof(RecordFile);
+
+    int interval = _Record->interval > 0 ? _Record->interval : RECORD_DEFAULT_INTERVAL;
+    _File->observed = _Record->observed;
+    _File->expires = _Record->observed != 0 ? _Record->observed + interval : 0;
+    _File->interval = _Record->interval;
+    _File->present = _Record->present;
+    memcpy(_File->values, _Record->values, sizeof(_File->values));
+    memcpy(_File->time, _Record->time, sizeof(_File->time));
+    _File->json_length = _JsonLength;
+}
+
+int record_decode(const RecordFile* _File, Record* _Record) {
+    if(_File->magic != RECORD_MAGIC || _File->version != RECORD_VERSION || _File->header_size != sizeof(RecordFile))
+        return -1;
+
+    memset(_Record, 0, sizeof(Record));
+    _Record->observed = (time_t)_File->observed;
+    _Record->interval = _File->interval;
+    _Record->present = _File->present & ((1u << Record_Field_Count) - 1);
+    memcpy(_Record->values, _File->values, sizeof(_Record->values));
+    memcpy(_Record->time, _File->time, sizeof(_Record->time));
+    _Record->time[sizeof(_Record->time) - 1] = '\0';
+    return 0;
+}
+
+int record_get(const Record* _Record, Record_Field _Field, double* _Value) {
+    if(_Record == NULL || (int)_Field < 0 || _Field >= Record_Field_Count)
+        return -1;
+    if(!(_Record->present & (1u << _Field)))
+        return -1;
+
+    if(_Value != NULL)
+        *(_Value) = _Record->values[_Field];
+    return 0;
+}
+
+time_t record_expiry(const Record* _Record, time_t _Validated) {
+    if(_Record == NULL || _Record->observed == 0)
+        return 0;
+
+    // A 304 revalidation makes the entry current again without changing its data
+    time_t since = _Record->observed;
+    if(_Validated > since)
+        since = _Validated;
+
+    int interval = _Record->interval > 0 ? _Record->interval : RECORD_DEFAULT_INTERVAL;
+    return since + interval;
+}
+
+int record_is_stale(const Record* _Record, time_t _Validated, time_t _Now) {
+    time_t expiry = record_expiry(_Record, _Validated);
+    if(expiry == 0)
+        return -1;
+
+    return _Now > expiry ? 1 : 0;
+}
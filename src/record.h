@@ -0,0 +1,93 @@
+#ifndef Record_h__
+#define Record_h__
+
+#include <time.h>
+#include <stdint.h>
+
+#include "jansson/jansson.h"
+
+/*
+ * A cached forecast decoded into plain values: the observation time, the update interval and
+ * the 15 variables of the "current" section. Only registered variables are requested, so
+ * upstream may leave some out; present has a bit for each one it sent.
+ */
+
+typedef enum {
+    Record_Field_Temperature2m,
+    Record_Field_RelativeHumidity2m,
+    Record_Field_ApparentTemperature,
+    Record_Field_IsDay,
+    Record_Field_Precipitation,
+    Record_Field_Rain,
+    Record_Field_Showers,
+    Record_Field_Snowfall,
+    Record_Field_WeatherCode,
+    Record_Field_CloudCover,
+    Record_Field_PressureMsl,
+    Record_Field_SurfacePressure,
+    Record_Field_WindSpeed10m,
+    Record_Field_WindDirection10m,
+    Record_Field_WindGusts10m,
+    Record_Field_Count
+} Record_Field;
+
+#define RECORD_DEFAULT_INTERVAL 900 // seconds, when upstream does not say
+
+typedef struct {
+    char time[32]; // as sent, e.g. "2025-10-04T16:15" (GMT)
+    time_t observed; // time parsed, 0 if missing or unparsable
+    int interval; // seconds, 0 if not sent
+    double values[Record_Field_Count];
+    unsigned int present; // (1 << field) for every variable that was sent
+} Record;
+
+/*
+ * On-disk form of a record, as kept in a slot of the cache store (store.h) and, before the
+ * store, in cache/<name>.rec files: a fixed layout, with json_length bytes of the upstream
+ * document kept next to it for export. Fields are in host byte order; the cache is not meant
+ * to be shared between machines. A reader rejects other magic numbers and versions, and the
+ * entry is fetched again.
+ */
+
+#define RECORD_MAGIC 0x57524543u // "CERW" read as little endian bytes
+#define RECORD_VERSION 1
+
+typedef struct {
+    uint32_t magic;
+    uint16_t version;
+    uint16_t header_size; // sizeof(RecordFile), where the passthrough JSON starts
+    int64_t expires; // observed + interval, epoch seconds
+    int64_t observed;
+    int32_t interval;
+    uint32_t present;
+    double values[Record_Field_Count];
+    char time[32];
+    uint32_t json_length; // 0 if the upstream document was not kept
+    uint32_t reserved;
+} RecordFile;
+
+// Upstream name of a variable, e.g. "temperature_2m"
+const char* record_field_name(Record_Field _Field);
+
+// Decodes the "current" section of a forecast document. Returns 0, or -1 if there is none.
+int record_from_json(json_t* _Root, Record* _Record);
+
+// A "current" section (inside an otherwise empty document) built from the record
+json_t* record_to_json(const Record* _Record);
+
+void record_encode(const Record* _Record, uint32_t _JsonLength, RecordFile* _File);
+// Returns 0, or -1 if _File is not a record this version can read
+int record_decode(const RecordFile* _File, Record* _Record);
+
+// Returns 0 and sets *_Value, or -1 if upstream did not send the variable
+int record_get(const Record* _Record, Record_Field _Field, double* _Value);
+
+// When the next observation is due: the later of observed and _Validated, plus the interval.
+// 0 if the record has no usable time.
+time_t record_expiry(const Record* _Record, time_t _Validated);
+
+// 1 once the next observation is due (the later of observed and _Validated plus the interval),
+// 0 before that, -1 if the record has no usable time
+int record_is_stale(const Record* _Record, time_t _Validated, time_t _Now);
+
+#endif // Record_h__
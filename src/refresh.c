@@ -0,0 +1,283 @@
+#include "refresh.h"
+
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <stdarg.h>
+#include <pthread.h>
+
+#include "http.h"
+#include "engine.h"
+#include "weather.h"
+#include "singleflight.h"
+#include "scheduler.h"
+
+// One city of a bulk refresh; flight is what concurrent callers for the same city wait on
+typedef struct {
+    City* city;
+    SingleFlight* flight;
+    int* failed;
+    int done;
+} RefreshTarget;
+
+// One multi-coordinate request covering a run of stale cities
+typedef struct {
+    char** names;
+    SingleFlight** flights;
+    int count;
+    char url[HTTP_MAX_URL_LENGTH];
+} RefreshBatch;
+
+// Progress of a lookup is shown at the prompt. Background work (the prefetch thread) must not
+// write into the middle of it: its failures go to stderr and the rest is left out.
+static void refresh_report(int _Failure, const char* _Format, ...) {
+    FILE* stream = stdout;
+    if(scheduler_thread_class() == Scheduler_Class_Background) {
+        if(!_Failure)
+            return;
+        stream = stderr;
+    }
+
+    va_list args;
+    va_start(args, _Format);
+    vfprintf(stream, _Format, args);
+    va_end(args);
+}
+
+// Fetches in streaming mode, so the response is parsed while it downloads.
+// Sends the cached validators along so an unchanged entry costs a 304 and nothing else.
+static json_t* refresh_city_work(void* _Context, int* _Status) {
+    City* city = (City*)_Context;
+    *(_Status) = -1;
+
+    const char* url = city_get_url(city);
+    if(url == NULL) {
+        refresh_report(1, "Failed to build request for %s.\n", city->name);
+        return NULL;
+    }
+
+    HttpValidators validators;
+    weather_read_validators(city->name, &validators);
+
+    long status = 0;
+    json_error_t error;
+    json_t* root = http_fetch_json_conditional(url, &validators, &status, &error);
+    if(status == 304) {
+        refresh_report(0, "Upstream data unchanged.\n");
+        weather_touch(city->name);
+        *(_Status) = 0;
+        return NULL;
+    }
+
+    if(root == NULL) {
+        refresh_report(1, "Failed to fetch weather for %s.\n", city->name);
+        return NULL;
+    }
+
+    *(_Status) = weather_write_json(city->name, root);
+    if(*(_Status) == 0)
+        weather_write_validators(city->name, &validators);
+
+    return root;
+}
+
+int refresh_city(City* _City, json_t** _Root) {
+    if(_City == NULL)
+        return -1;
+
+    int status = -1;
+    json_t* root = singleflight_do(_City->name, refresh_city_work, _City, &status);
+
+    if(_Root != NULL)
+        *(_Root) = root;
+    else
+        json_decref(root);
+
+    return status;
+}
+
+// Engine completion callback: hands the response buffer straight to the weather cache
+static void refresh_write(const char* _Url, char* _Data, size_t _Size, long _Status, void* _Userdata) {
+    (void)_Url; (void)_Size; (void)_Status;
+    RefreshTarget* target = (RefreshTarget*)_Userdata;
+    target->done = 1;
+
+    if(_Data == NULL) {
+        printf("Failed to refresh %s\n", target->city->name);
+        *(target->failed) += 1;
+        singleflight_finish(target->flight, NULL, -1);
+        return;
+    }
+
+    int status = weather_write(target->city->name, _Data);
+    if(status != 0)
+        *(target->failed) += 1;
+    singleflight_finish(target->flight, NULL, status);
+    http_free(_Data);
+}
+
+int refresh_cities(Cities* _Cities, int _MaxInFlight) {
+    if(_Cities == NULL || _Cities->list.length == 0)
+        return -1;
+
+    FetchEngine* engine = NULL;
+    if(engine_init(&engine, _MaxInFlight) != 0)
+        return -2;
+
+    RefreshTarget* targets = (RefreshTarget*)malloc(sizeof(RefreshTarget) * _Cities->list.length);
+    if(targets == NULL) {
+        engine_dispose(&engine);
+        return -2;
+    }
+
+    // Transfers take the class of the thread that submits them
+    Scheduler_Class previous = scheduler_thread_class();
+    scheduler_set_thread_class(Scheduler_Class_Background);
+
+    int count = 0;
+    int failed = 0;
+    City* city = NULL;
+    LinkedList_ForEach(&_Cities->list, &city) {
+        // Someone else is already refreshing this city; their result lands in the same cache file
+        int leader = 0;
+        SingleFlight* flight = singleflight_join(city->name, &leader);
+        if(!leader) {
+            singleflight_leave(flight);
+            continue;
+        }
+
+        RefreshTarget* target = &targets[count++];
+        target->city = city;
+        target->flight = flight;
+        target->failed = &failed;
+        target->done = 0;
+
+        const char* url = city_get_url(city);
+        if(url == NULL || engine_submit(engine, url, refresh_write, target) != 0)
+            refresh_write(url, NULL, 0, 0, target);
+    }
+
+    int result = engine_run(engine);
+    engine_dispose(&engine);
+    scheduler_set_thread_class(previous);
+
+    // The loop only stops early on an epoll error; release whoever waits on the cities it dropped
+    for(int i = 0; result != 0 && i < count; i++) {
+        if(!targets[i].done)
+            refresh_write(NULL, NULL, 0, 0, &targets[i]);
+    }
+
+    free(targets);
+    return failed;
+}
+
+static void refresh_finish_batch(RefreshBatch* _Batch, int _Status) {
+    for(int i = 0; i < _Batch->count; i++)
+        singleflight_finish(_Batch->flights[i], NULL, _Status);
+}
+
+static void refresh_write_batch(HttpRequest* _Request, char* _Data, void* _Context) {
+    int* failed = (int*)_Context;
+    RefreshBatch* batch = (RefreshBatch*)_Request->userdata;
+
+    if(_Data == NULL) {
+        printf("Failed to refresh %i cities\n", batch->count);
+        *(failed) += batch->count;
+        refresh_finish_batch(batch, -1);
+        return;
+    }
+
+    int batch_failed = weather_write_batch(batch->names, batch->count, _Data);
+    *(failed) += batch_failed;
+    refresh_finish_batch(batch, batch_failed == 0 ? 0 : -1);
+    http_free(_Data);
+}
+
+static int refresh_is_stale(City* _City) {
+    return weather_is_stale(_City->name) != 0; // missing and unreadable entries are refetched too
+}
+
+int refresh_stale_cities(Cities* _Cities, int _MaxInFlight) {
+    if(_Cities == NULL || _Cities->list.length == 0)
+        return -1;
+
+    int length = _Cities->list.length;
+    char** names = (char**)malloc(sizeof(char*) * length);
+    SingleFlight** flights = (SingleFlight**)malloc(sizeof(SingleFlight*) * length);
+    double* latitudes = (double*)malloc(sizeof(double) * length);
+    double* longitudes = (double*)malloc(sizeof(double) * length);
+    RefreshBatch* batches = (RefreshBatch*)malloc(sizeof(RefreshBatch) * length);
+    HttpRequest* requests = (HttpRequest*)malloc(sizeof(HttpRequest) * length);
+    if(names == NULL || flights == NULL || latitudes == NULL || longitudes == NULL || batches == NULL || requests == NULL) {
+        free(names);
+        free(flights);
+        free(latitudes);
+        free(longitudes);
+        free(batches);
+        free(requests);
+        return -2;
+    }
+
+    int count = 0;
+    City* city = NULL;
+    LinkedList_ForEach(&_Cities->list, &city) {
+        if(!refresh_is_stale(city))
+            continue;
+
+        int leader = 0;
+        SingleFlight* flight = singleflight_join(city->name, &leader);
+        if(!leader) {
+            singleflight_leave(flight); // already being refreshed by another caller
+            continue;
+        }
+
+        names[count] = city->name;
+        flights[count] = flight;
+        latitudes[count] = city->latitude;
+        longitudes[count] = city->longitude;
+        count++;
+    }
+
+    // Pack as many coordinates as fit into each URL
+    int batch_count = 0;
+    int failed = 0;
+    for(int i = 0; i < count; ) {
+        RefreshBatch* batch = &batches[batch_count];
+        int used = http_build_batch_url(batch->url, sizeof(batch->url), &latitudes[i], &longitudes[i], count - i);
+        if(used <= 0) {
+            failed += count - i;
+            for(; i < count; i++)
+                singleflight_finish(flights[i], NULL, -1);
+            break;
+        }
+
+        batch->names = &names[i];
+        batch->flights = &flights[i];
+        batch->count = used;
+
+        requests[batch_count].url = batch->url;
+        requests[batch_count].userdata = batch;
+        batch_count++;
+        i += used;
+    }
+
+    if(batch_count > 0) {
+        Scheduler_Class previous = scheduler_thread_class();
+        scheduler_set_thread_class(Scheduler_Class_Background);
+        int result = http_fetch_many(requests, batch_count, _MaxInFlight, refresh_write_batch, &failed);
+        scheduler_set_thread_class(previous);
+        if(result < 0) {
+            failed = count;
+            for(int i = 0; i < batch_count; i++)
+                refresh_finish_batch(&batches[i], -1);
+        }
+    }
+
+    free(names);
+    free(flights);
+    free(latitudes);
+    free(longitudes);
+    free(batches);
+    free(requests);
+    return failed;
+}
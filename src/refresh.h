@@ -0,0 +1,28 @@
+#ifndef Refresh_h__
+#define Refresh_h__
+
+#include "cities.h"
+#include "jansson/jansson.h"
+
+// Refreshes one city (conditional GET, streamed parse, cache write). Concurrent calls for the
+// same city share one upstream request and all receive its result. Returns 0 when the cache is
+// current afterwards; *_Root (optional) gets the new document, or NULL if upstream had nothing new.
+int refresh_city(City* _City, json_t** _Root);
+
+// Serving stale entries: a lookup may show an entry that has been stale for up to this many
+// seconds while the prefetch thread (prefetch_request) brings it up to date; older ones are
+// refreshed first
+#define REFRESH_DEFAULT_MAX_STALENESS 900
+
+// Cities that are already being refreshed by another caller are skipped by the bulk refreshes below.
+// They run as background work, so lookups through refresh_city are admitted ahead of them.
+
+// Fetches every city in the registry concurrently and writes each response to the cache
+// as soon as it arrives. Returns the number of cities that could not be refreshed.
+int refresh_cities(Cities* _Cities, int _MaxInFlight);
+
+// Refreshes only missing or stale cities, packing their coordinates into as few
+// multi-coordinate requests as the URL length allows. Returns the number of failures.
+int refresh_stale_cities(Cities* _Cities, int _MaxInFlight);
+
+#endif // Refresh_h__
@@ -0,0 +1,85 @@
+#include "request.h"
+
+#include <stdio.h>
+#include <string.h>
+
+#define REQUEST_LIST_SIZE 512
+
+static const char* section_names[Request_Section_Count] = { "current", "hourly", "daily" };
+
+static char variables[Request_Section_Count][REQUEST_LIST_SIZE];
+static char base_url[256] = REQUEST_DEFAULT_BASE_URL;
+static unsigned int generation = 1;
+
+static int request_is_registered(const char* _List, const char* _Variable) {
+    size_t length = strlen(_Variable);
+    const char* ptr = _List;
+
+    while((ptr = strstr(ptr, _Variable)) != NULL) {
+        int starts = ptr == _List || *(ptr - 1) == ',';
+        int ends = ptr[length] == '\0' || ptr[length] == ',';
+        if(starts && ends)
+            return 1;
+
+        ptr += length;
+    }
+
+    return 0;
+}
+
+int request_register(Request_Section _Section, const char* _Variable) {
+    if((int)_Section < 0 || _Section >= Request_Section_Count || _Variable == NULL || _Variable[0] == '\0')
+        return -1;
+
+    // Variable names go straight into the query string
+    for(const char* ptr = _Variable; *ptr != '\0'; ptr++) {
+        if(!((*ptr >= 'a' && *ptr <= 'z') || (*ptr >= '0' && *ptr <= '9') || *ptr == '_'))
+            return -1;
+    }
+
+    char* list = variables[_Section];
+    if(request_is_registered(list, _Variable))
+        return 1;
+
+    size_t used = strlen(list);
+    if(used + strlen(_Variable) + 2 > REQUEST_LIST_SIZE)
+        return -2;
+
+    if(used > 0)
+        list[used++] = ',';
+    strcpy(list + used, _Variable);
+
+    generation++;
+    return 0;
+}
+
+void request_set_base_url(const char* _BaseUrl) {
+    snprintf(base_url, sizeof(base_url), "%s", _BaseUrl != NULL ? _BaseUrl : REQUEST_DEFAULT_BASE_URL);
+    generation++;
+}
+
+unsigned int request_generation() {
+    return generation;
+}
+
+int request_build_url(char* _Buffer, size_t _Size, const char* _Latitudes, const char* _Longitudes) {
+    if(_Buffer == NULL || _Latitudes == NULL || _Longitudes == NULL)
+        return -1;
+
+    int length = snprintf(_Buffer, _Size, "%s/v1/forecast?latitude=%s&longitude=%s", base_url, _Latitudes, _Longitudes);
+    if(length < 0 || (size_t)length >= _Size)
+        return -1;
+
+    // Only sections somebody asked for end up in the URL
+    for(int i = 0; i < Request_Section_Count; i++) {
+        if(variables[i][0] == '\0')
+            continue;
+
+        int added = snprintf(_Buffer + length, _Size - length, "&%s=%s", section_names[i], variables[i]);
+        if(added < 0 || (size_t)(length + added) >= _Size)
+            return -1;
+        length += added;
+    }
+
+    return length;
+}
@@ -0,0 +1,29 @@
+#ifndef Request_h__
+#define Request_h__
+
+#include <stddef.h>
+
+/*
+ * Builds forecast URLs that ask only for the variables some consumer has registered.
+ * Every change (new variable, new base URL) bumps the generation so cached URLs can
+ * tell that they are out of date.
+ */
+
+typedef enum {
+    Request_Section_Current = 0,
+    Request_Section_Hourly = 1,
+    Request_Section_Daily = 2,
+    Request_Section_Count
+} Request_Section;
+
+#define REQUEST_DEFAULT_BASE_URL "https://api.open-meteo.com"
+
+int request_register(Request_Section _Section, const char* _Variable);
+void request_set_base_url(const char* _BaseUrl);
+unsigned int request_generation();
+
+// _Latitudes/_Longitudes are already formatted (one value or a comma separated list).
+// Returns the URL length, or -1 if it does not fit.
+int request_build_url(char* _Buffer, size_t _Size, const char* _Latitudes, const char* _Longitudes);
+
+#endif // Request_h__
@@ -0,0 +1,117 @@
+#include "scheduler.h"
+
+#include <pthread.h>
+
+#include "ratelimit.h"
+#include "limit.h"
+
+#define NS_PER_MS 1000000LL
+
+static double background_share = SCHEDULER_DEFAULT_BACKGROUND_SHARE;
+
+static int active = 0;
+static int background_active = 0;
+static int interactive_waiting = 0;
+
+static pthread_mutex_t scheduler_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t scheduler_changed = PTHREAD_COND_INITIALIZER;
+
+static __thread Scheduler_Class thread_class = Scheduler_Class_Interactive;
+
+void scheduler_configure(double _BackgroundShare) {
+    if(_BackgroundShare < 0)
+        _BackgroundShare = 0;
+    if(_BackgroundShare > 1)
+        _BackgroundShare = 1;
+
+    pthread_mutex_lock(&scheduler_lock);
+    background_share = _BackgroundShare;
+    pthread_cond_broadcast(&scheduler_changed);
+    pthread_mutex_unlock(&scheduler_lock);
+}
+
+void scheduler_set_thread_class(Scheduler_Class _Class) {
+    thread_class = _Class;
+}
+
+Scheduler_Class scheduler_thread_class() {
+    return thread_class;
+}
+
+// Must be called with scheduler_lock held
+static int scheduler_has_slot(Scheduler_Class _Class) {
+    int slots = limit_current();
+    if(active >= slots)
+        return 0;
+    if(_Class == Scheduler_Class_Interactive)
+        return 1;
+
+    int background_slots = (int)(slots * background_share);
+    if(background_slots < 1)
+        background_slots = 1; // otherwise background work could never finish
+    return interactive_waiting == 0 && background_active < background_slots;
+}
+
+// Must be called with scheduler_lock held
+static void scheduler_take(Scheduler_Class _Class) {
+    active++;
+    if(_Class == Scheduler_Class_Background)
+        background_active++;
+}
+
+static int scheduler_token_reserve(Scheduler_Class _Class) {
+    return _Class == Scheduler_Class_Background ? SCHEDULER_BACKGROUND_TOKEN_RESERVE : 0;
+}
+
+void scheduler_admit(Scheduler_Class _Class) {
+    pthread_mutex_lock(&scheduler_lock);
+    if(!scheduler_has_slot(_Class)) {
+        // Announce the wait so background work stops taking the slots that free up
+        if(_Class == Scheduler_Class_Interactive)
+            interactive_waiting++;
+        while(!scheduler_has_slot(_Class))
+            pthread_cond_wait(&scheduler_changed, &scheduler_lock);
+        if(_Class == Scheduler_Class_Interactive) {
+            interactive_waiting--;
+            pthread_cond_broadcast(&scheduler_changed);
+        }
+    }
+    scheduler_take(_Class);
+    pthread_mutex_unlock(&scheduler_lock);
+
+    ratelimit_acquire_reserve(scheduler_token_reserve(_Class));
+}
+
+long long scheduler_try_admit(Scheduler_Class _Class) {
+    pthread_mutex_lock(&scheduler_lock);
+    int admitted = scheduler_has_slot(_Class);
+    if(admitted)
+        scheduler_take(_Class);
+    pthread_mutex_unlock(&scheduler_lock);
+
+    if(!admitted)
+        return SCHEDULER_RETRY_MS * NS_PER_MS;
+
+    long long wait = ratelimit_try_acquire_reserve(scheduler_token_reserve(_Class));
+    if(wait > 0)
+        scheduler_release(_Class);
+    return wait;
+}
+
+void scheduler_finish(Scheduler_Class _Class, double _RttMs, int _Healthy) {
+    pthread_mutex_lock(&scheduler_lock);
+    int in_flight = active;
+    pthread_mutex_unlock(&scheduler_lock);
+
+    limit_sample(_RttMs, in_flight, !_Healthy);
+    scheduler_release(_Class);
+}
+
+void scheduler_release(Scheduler_Class _Class) {
+    pthread_mutex_lock(&scheduler_lock);
+    active--;
+    if(_Class == Scheduler_Class_Background)
+        background_active--;
+    pthread_cond_broadcast(&scheduler_changed);
+    pthread_mutex_unlock(&scheduler_lock);
+}
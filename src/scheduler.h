@@ -0,0 +1,44 @@
+#ifndef Scheduler_h__
+#define Scheduler_h__
+
+/*
+ * Admission to upstream for every fetch path. An attempt needs a slot (a concurrent transfer,
+ * as many as the adaptive limit in limit.h allows) and a rate-limit token. Interactive work
+ * (a user waiting on a lookup) may use every slot and the whole token bucket. Background work
+ * (bulk refreshes) is held to a share of the slots and leaves a few tokens in the bucket, and
+ * it is admitted only while no interactive caller waits. A lookup therefore never queues
+ * behind a refresh storm.
+ */
+
+typedef enum {
+    Scheduler_Class_Interactive,
+    Scheduler_Class_Background
+} Scheduler_Class;
+
+#define SCHEDULER_DEFAULT_BACKGROUND_SHARE 0.75
+#define SCHEDULER_BACKGROUND_TOKEN_RESERVE 2 // tokens background work leaves for interactive lookups
+#define SCHEDULER_RETRY_MS 5 // how soon a non-blocking caller denied a slot should ask again
+
+// Background work may hold _BackgroundShare of the current limit (clamped to [0, 1], but
+// always at least one slot)
+void scheduler_configure(double _BackgroundShare);
+
+// The class of fetches started by the calling thread; interactive unless set otherwise
+void scheduler_set_thread_class(Scheduler_Class _Class);
+Scheduler_Class scheduler_thread_class();
+
+// Takes a slot and a token for one attempt, blocking until both are available
+void scheduler_admit(Scheduler_Class _Class);
+
+// Takes a slot and a token and returns 0, or takes neither and returns the number of
+// nanoseconds to wait before asking again, for callers that run their own event loop
+long long scheduler_try_admit(Scheduler_Class _Class);
+
+// Gives back the slot of an attempt that reached upstream, feeding its round trip time and
+// outcome to the adaptive limit
+void scheduler_finish(Scheduler_Class _Class, double _RttMs, int _Healthy);
+
+// Gives back the slot of an attempt that never reached upstream
+void scheduler_release(Scheduler_Class _Class);
+
+#endif // Scheduler_h__
@@ -0,0 +1,122 @@
+#include "singleflight.h"
+
+#include <stdlib.h>
+#include <string.h>
+#include <pthread.h>
+
+#include "linkedlist.h"
+#include "utils.h"
+
+struct SingleFlight {
+    char* key;
+    int references;
+    int done;
+    int status;
+    json_t* value;
+    pthread_cond_t cond;
+};
+
+// Flights that have not finished yet
+static LinkedList flights;
+static pthread_mutex_t flights_lock = PTHREAD_MUTEX_INITIALIZER;
+
+// Must be called with flights_lock held
+static void singleflight_release(SingleFlight* _Flight) {
+    if(--_Flight->references > 0)
+        return;
+
+    json_decref(_Flight->value);
+    pthread_cond_destroy(&_Flight->cond);
+    free(_Flight->key);
+    free(_Flight);
+}
+
+SingleFlight* singleflight_join(const char* _Key, int* _Leader) {
+    if(_Key == NULL || _Leader == NULL)
+        return NULL;
+
+    pthread_mutex_lock(&flights_lock);
+
+    SingleFlight* flight = NULL;
+    LinkedList_ForEach(&flights, &flight) {
+        if(strcmp(flight->key, _Key) == 0) {
+            flight->references++;
+            *(_Leader) = 0;
+            pthread_mutex_unlock(&flights_lock);
+            return flight;
+        }
+    }
+
+    flight = (SingleFlight*)calloc(1, sizeof(SingleFlight));
+    if(flight != NULL) {
+        flight->key = strdup(_Key);
+        if(flight->key == NULL || LinkedList_Push(&flights, flight) != 0) {
+            free(flight->key);
+            free(flight);
+            flight = NULL;
+        } else {
+            pthread_cond_init(&flight->cond, NULL);
+            flight->references = 1;
+            *(_Leader) = 1;
+        }
+    }
+
+    pthread_mutex_unlock(&flights_lock);
+    return flight;
+}
+
+void singleflight_finish(SingleFlight* _Flight, json_t* _Value, int _Status) {
+    if(_Flight == NULL)
+        return;
+
+    pthread_mutex_lock(&flights_lock);
+    _Flight->value = json_incref(_Value);
+    _Flight->status = _Status;
+    _Flight->done = 1;
+    LinkedList_Remove(&flights, _Flight); // the next caller for this key starts a new flight
+    pthread_cond_broadcast(&_Flight->cond);
+    singleflight_release(_Flight);
+    pthread_mutex_unlock(&flights_lock);
+}
+
+json_t* singleflight_wait(SingleFlight* _Flight, int* _Status) {
+    if(_Flight == NULL)
+        return NULL;
+
+    pthread_mutex_lock(&flights_lock);
+    while(!_Flight->done)
+        pthread_cond_wait(&_Flight->cond, &flights_lock);
+
+    json_t* value = json_incref(_Flight->value);
+    if(_Status != NULL)
+        *(_Status) = _Flight->status;
+
+    singleflight_release(_Flight);
+    pthread_mutex_unlock(&flights_lock);
+    return value;
+}
+
+void singleflight_leave(SingleFlight* _Flight) {
+    if(_Flight == NULL)
+        return;
+
+    pthread_mutex_lock(&flights_lock);
+    singleflight_release(_Flight);
+    pthread_mutex_unlock(&flights_lock);
+}
+
+json_t* singleflight_do(const char* _Key, SingleFlightWork _Work, void* _Context, int* _Status) {
+    int leader = 0;
+    SingleFlight* flight = singleflight_join(_Key, &leader);
+    if(flight != NULL && !leader)
+        return singleflight_wait(flight, _Status);
+
+    int status = 0;
+    json_t* value = _Work(_Context, &status);
+    if(flight != NULL)
+        singleflight_finish(flight, value, status); // flight == NULL: could not be tracked, the work ran untracked
+
+    if(_Status != NULL)
+        *(_Status) = status;
+    return value;
+}
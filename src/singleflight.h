@@ -0,0 +1,27 @@
+#ifndef Singleflight_h__
+#define Singleflight_h__
+
+#include "jansson/jansson.h"
+
+/*
+ * Single-flight table: at most one piece of work per key runs at a time. Callers that
+ * arrive while it runs wait for it and get the same result (each with its own reference).
+ * Once a flight has finished the key is free again, so later callers start a new one.
+ */
+
+typedef struct SingleFlight SingleFlight;
+
+// The work run by the leader. The returned value may be NULL, *_Status is passed to every waiter.
+typedef json_t* (*SingleFlightWork)(void* _Context, int* _Status);
+
+// Runs _Work for _Key, or waits for the call already in flight. Returns a new reference.
+json_t* singleflight_do(const char* _Key, SingleFlightWork _Work, void* _Context, int* _Status);
+
+// Lower level API for callers that drive the work themselves (e.g. one transfer for several keys).
+// If *_Leader is set the caller must call singleflight_finish, otherwise singleflight_wait or singleflight_leave.
+SingleFlight* singleflight_join(const char* _Key, int* _Leader);
+void singleflight_finish(SingleFlight* _Flight, json_t* _Value, int _Status);
+json_t* singleflight_wait(SingleFlight* _Flight, int* _Status);
+void singleflight_leave(SingleFlight* _Flight);
+
+#endif // Singleflight_h__
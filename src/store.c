@@ -0,0 +1,525 @@
+#define _GNU_SOURCE
+
+#include "store.h"
+
+#include <stdio.h>
+#include <stdint.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sched.h>
+#include <pthread.h>
+#include <sys/file.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+#define STORE_MAGIC 0x53524557u // "WERS" read as little endian bytes
+#define STORE_VERSION 2
+#define STORE_INDEX_SIZE (STORE_SLOTS * 2) // open addressing, never more than half full
+#define STORE_SLOT_RECORD 1u
+#define STORE_SLOT_WRITTEN 2u // has had a record, so entries from before the store are not imported
+
+typedef struct {
+    uint32_t magic;
+    uint16_t version;
+    uint16_t slot_size;
+    uint32_t slot_count;
+    uint32_t overflow_size;
+    uint32_t overflow_used; // bump allocated under the file lock
+    uint32_t reserved[3];
+} StoreHeader;
+
+typedef struct {
+    uint32_t sequence; // odd while a writer is inside
+    uint32_t flags;
+    char name[64]; // empty while the slot is free, never changes once claimed
+    int64_t validated;
+    char etag[128];
+    char last_modified[64];
+    RecordFile record; // record.json_length is the size of the kept document
+    uint32_t json_offset; // into the overflow area
+    uint32_t json_capacity; // 0 if no overflow space belongs to the slot
+} StoreSlot;
+
+static int store_fd = -1;
+static unsigned char* store_map = NULL;
+static size_t store_size = 0;
+static StoreHeader* header = NULL;
+static int64_t* expiry_index = NULL; // STORE_SLOTS entries between the header and the slots
+static StoreSlot* slots = NULL;
+static unsigned char* overflow = NULL;
+
+// ID + 1 per bucket, 0 when empty; names are compared against the (immutable) slot names
+static int index_ids[STORE_INDEX_SIZE];
+
+static pthread_mutex_t store_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_mutex_t store_write_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_once_t store_once = PTHREAD_ONCE_INIT;
+
+static size_t store_expected_size() {
+    return sizeof(StoreHeader) + sizeof(int64_t) * STORE_SLOTS + sizeof(StoreSlot) * STORE_SLOTS + STORE_OVERFLOW_SIZE;
+}
+
+static int store_header_valid(const StoreHeader* _Header) {
+    return _Header->magic == STORE_MAGIC && _Header->version == STORE_VERSION &&
+           _Header->slot_size == sizeof(StoreSlot) && _Header->slot_count == STORE_SLOTS &&
+           _Header->overflow_size == STORE_OVERFLOW_SIZE && _Header->overflow_used <= STORE_OVERFLOW_SIZE;
+}
+
+// Must be called with store_lock held
+static int store_map_file(const char* _Path) {
+    int fd = open(_Path, O_RDWR | O_CREAT, 0644);
+    if(fd < 0 && errno == ENOENT) {
+        mkdir("cache", 0755);
+        fd = open(_Path, O_RDWR | O_CREAT, 0644);
+    }
+    if(fd < 0) {
+        fprintf(stderr, "Could not open cache store %s\n", _Path);
+        return -1;
+    }
+
+    size_t size = store_expected_size();
+    flock(fd, LOCK_EX);
+
+    // A new file, or one laid out by another version, starts over empty
+    StoreHeader existing;
+    memset(&existing, 0, sizeof(existing));
+    struct stat st;
+    int valid = fstat(fd, &st) == 0 && (size_t)st.st_size == size &&
+                pread(fd, &existing, sizeof(existing), 0) == (ssize_t)sizeof(existing) &&
+                store_header_valid(&existing);
+    if(!valid) {
+        StoreHeader fresh = {0};
+        fresh.magic = STORE_MAGIC;
+        fresh.version = STORE_VERSION;
+        fresh.slot_size = sizeof(StoreSlot);
+        fresh.slot_count = STORE_SLOTS;
+        fresh.overflow_size = STORE_OVERFLOW_SIZE;
+
+        if(ftruncate(fd, 0) != 0 || ftruncate(fd, size) != 0 ||
+           pwrite(fd, &fresh, sizeof(fresh), 0) != (ssize_t)sizeof(fresh)) {
+            flock(fd, LOCK_UN);
+            close(fd);
+            fprintf(stderr, "Could not initialize cache store %s\n", _Path);
+            return -1;
+        }
+    }
+
+    void* map = mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+    flock(fd, LOCK_UN);
+    if(map == MAP_FAILED) {
+        close(fd);
+        fprintf(stderr, "Could not map cache store %s\n", _Path);
+        return -1;
+    }
+
+    store_fd = fd;
+    store_map = (unsigned char*)map;
+    store_size = size;
+    header = (StoreHeader*)store_map;
+    expiry_index = (int64_t*)(store_map + sizeof(StoreHeader));
+    slots = (StoreSlot*)(expiry_index + STORE_SLOTS);
+    overflow = (unsigned char*)(slots + STORE_SLOTS);
+    memset(index_ids, 0, sizeof(index_ids));
+    return 0;
+}
+
+// Must be called with store_lock held
+static void store_unmap() {
+    if(store_map != NULL)
+        munmap(store_map, store_size);
+    if(store_fd >= 0)
+        close(store_fd);
+
+    store_fd = -1;
+    store_map = NULL;
+    store_size = 0;
+    header = NULL;
+    expiry_index = NULL;
+    slots = NULL;
+    overflow = NULL;
+}
+
+int store_open(const char* _Path) {
+    if(_Path == NULL)
+        return -1;
+
+    pthread_mutex_lock(&store_lock);
+    store_unmap();
+    int result = store_map_file(_Path);
+    pthread_mutex_unlock(&store_lock);
+
+    return result;
+}
+
+void store_close() {
+    pthread_mutex_lock(&store_lock);
+    store_unmap();
+    pthread_mutex_unlock(&store_lock);
+}
+
+static void store_open_default() {
+    pthread_mutex_lock(&store_lock);
+    if(store_map == NULL)
+        store_map_file(STORE_PATH);
+    pthread_mutex_unlock(&store_lock);
+}
+
+static int store_ready() {
+    pthread_once(&store_once, store_open_default);
+    return slots != NULL;
+}
+
+static int store_valid_id(int _Id) {
+    return store_ready() && _Id >= 0 && _Id < STORE_SLOTS;
+}
+
+// Writer lock: the mutex orders this process's threads, the file lock other processes. The
+// kernel drops the file lock of a process that dies, so a crashed writer never leaves it held.
+
+static void store_lock_writers() {
+    pthread_mutex_lock(&store_write_lock);
+    flock(store_fd, LOCK_EX);
+}
+
+static void store_unlock_writers() {
+    flock(store_fd, LOCK_UN);
+    pthread_mutex_unlock(&store_write_lock);
+}
+
+// Sequence protocol
+
+// Must be called with the writer lock held, so no other writer can be inside the slot
+static void store_begin_write(StoreSlot* _Slot) {
+    uint32_t sequence = __atomic_load_n(&_Slot->sequence, __ATOMIC_RELAXED);
+    if(sequence & 1) {
+        // Left odd by a writer that died inside; what it wrote may be torn, so the record is
+        // dropped (and fetched again) unless the write that follows replaces it
+        _Slot->flags &= ~STORE_SLOT_RECORD;
+        sequence++;
+    }
+
+    __atomic_store_n(&_Slot->sequence, sequence + 1, __ATOMIC_RELAXED);
+    __atomic_thread_fence(__ATOMIC_RELEASE);
+}
+
+static void store_end_write(StoreSlot* _Slot) {
+    __atomic_add_fetch(&_Slot->sequence, 1, __ATOMIC_RELEASE);
+}
+
+static uint32_t store_begin_read(const StoreSlot* _Slot) {
+    for(int spins = 0; spins < STORE_SPIN_LIMIT; spins++) {
+        uint32_t sequence = __atomic_load_n(&_Slot->sequence, __ATOMIC_ACQUIRE);
+        if(!(sequence & 1))
+            return sequence;
+
+        sched_yield();
+    }
+
+    return 1; // never valid, so the read fails
+}
+
+static int store_end_read(const StoreSlot* _Slot, uint32_t _Sequence) {
+    __atomic_thread_fence(__ATOMIC_ACQUIRE);
+    return !(_Sequence & 1) && __atomic_load_n(&_Slot->sequence, __ATOMIC_RELAXED) == _Sequence;
+}
+
+// Index
+
+static unsigned int store_hash(const char* _Name) {
+    unsigned int hash = 2166136261u;
+    for(const unsigned char* ptr = (const unsigned char*)_Name; *ptr != '\0'; ptr++)
+        hash = (hash ^ *ptr) * 16777619u;
+
+    return hash;
+}
+
+// Must be called with store_lock held
+static void store_index_add(const char* _Name, int _Id) {
+    unsigned int bucket = store_hash(_Name) % STORE_INDEX_SIZE;
+    while(index_ids[bucket] != 0) {
+        if(index_ids[bucket] == _Id + 1)
+            return;
+        bucket = (bucket + 1) % STORE_INDEX_SIZE;
+    }
+
+    index_ids[bucket] = _Id + 1;
+}
+
+// Must be called with store_lock held
+static int store_index_find(const char* _Name) {
+    unsigned int bucket = store_hash(_Name) % STORE_INDEX_SIZE;
+    while(index_ids[bucket] != 0) {
+        int id = index_ids[bucket] - 1;
+        if(strcmp(slots[id].name, _Name) == 0)
+            return id;
+        bucket = (bucket + 1) % STORE_INDEX_SIZE;
+    }
+
+    return -1;
+}
+
+// Must be called with store_lock held. Picks up slots claimed by other processes.
+static int store_scan(const char* _Name) {
+    int found = -1;
+    for(int i = 0; i < STORE_SLOTS; i++) {
+        StoreSlot* slot = &slots[i];
+
+        char name[sizeof(slot->name)];
+        uint32_t sequence;
+        do {
+            sequence = store_begin_read(slot);
+            if(sequence & 1)
+                break;
+            memcpy(name, slot->name, sizeof(name));
+        } while(!store_end_read(slot, sequence));
+
+        if(sequence & 1)
+            continue;
+        name[sizeof(name) - 1] = '\0';
+        if(name[0] == '\0')
+            continue;
+
+        store_index_add(name, i);
+        if(strcmp(name, _Name) == 0)
+            found = i;
+    }
+
+    return found;
+}
+
+int store_find(const char* _Name) {
+    if(_Name == NULL || !store_ready())
+        return -1;
+
+    pthread_mutex_lock(&store_lock);
+    int id = store_index_find(_Name);
+    if(id < 0)
+        id = store_scan(_Name);
+    pthread_mutex_unlock(&store_lock);
+
+    return id;
+}
+
+int store_claim(const char* _Name) {
+    if(_Name == NULL || _Name[0] == '\0' || strlen(_Name) >= sizeof(slots[0].name) || !store_ready())
+        return -1;
+
+    pthread_mutex_lock(&store_lock);
+    int id = store_index_find(_Name);
+    if(id >= 0) {
+        pthread_mutex_unlock(&store_lock);
+        return id;
+    }
+
+    store_lock_writers();
+    id = store_scan(_Name);
+    for(int i = 0; id < 0 && i < STORE_SLOTS; i++) {
+        if(slots[i].name[0] != '\0')
+            continue;
+
+        StoreSlot* slot = &slots[i];
+        store_begin_write(slot);
+        memset((char*)slot + sizeof(slot->sequence), 0, sizeof(StoreSlot) - sizeof(slot->sequence));
+        snprintf(slot->name, sizeof(slot->name), "%s", _Name);
+        store_end_write(slot);
+
+        store_index_add(_Name, i);
+        id = i;
+    }
+    store_unlock_writers();
+    pthread_mutex_unlock(&store_lock);
+
+    if(id < 0)
+        fprintf(stderr, "Cache store is full, %s is not cached\n", _Name);
+    return id;
+}
+
+int store_read(int _Id, StoreEntry* _Entry) {
+    if(_Entry == NULL || !store_valid_id(_Id))
+        return -1;
+
+    StoreSlot* slot = &slots[_Id];
+    StoreSlot copy;
+    uint32_t sequence;
+    do {
+        sequence = store_begin_read(slot);
+        if(sequence & 1)
+            return -1;
+        memcpy(&copy, slot, sizeof(copy));
+    } while(!store_end_read(slot, sequence));
+
+    if(copy.name[0] == '\0')
+        return -1;
+
+    memset(_Entry, 0, sizeof(StoreEntry));
+    _Entry->has_record = (copy.flags & STORE_SLOT_RECORD) && record_decode(&copy.record, &_Entry->record) == 0;
+    _Entry->validated = (time_t)copy.validated;
+    snprintf(_Entry->validators.etag, sizeof(_Entry->validators.etag), "%.*s", (int)sizeof(copy.etag) - 1, copy.etag);
+    snprintf(_Entry->validators.last_modified, sizeof(_Entry->validators.last_modified), "%.*s",
+             (int)sizeof(copy.last_modified) - 1, copy.last_modified);
+    _Entry->json_length = _Entry->has_record ? copy.record.json_length : 0;
+    return 0;
+}
+
+int store_read_json(int _Id, char* _Buffer, size_t _Size) {
+    if(_Buffer == NULL || !store_valid_id(_Id))
+        return -1;
+
+    StoreSlot* slot = &slots[_Id];
+    uint32_t sequence;
+    int length;
+    do {
+        sequence = store_begin_read(slot);
+        if(sequence & 1)
+            return -1;
+
+        uint32_t offset = slot->json_offset;
+        length = (int)slot->record.json_length;
+        if(length <= 0 || (size_t)length > _Size || offset + (size_t)length > STORE_OVERFLOW_SIZE) {
+            length = -1;
+            continue;
+        }
+        memcpy(_Buffer, overflow + offset, length);
+    } while(!store_end_read(slot, sequence));
+
+    return length;
+}
+
+// Must be called inside the slot's write, after the record or validation time changed
+static void store_update_expiry(int _Id) {
+    StoreSlot* slot = &slots[_Id];
+
+    Record record;
+    int64_t expiry = 0;
+    if((slot->flags & STORE_SLOT_RECORD) && record_decode(&slot->record, &record) == 0)
+        expiry = record_expiry(&record, (time_t)slot->validated);
+
+    __atomic_store_n(&expiry_index[_Id], expiry, __ATOMIC_RELEASE);
+}
+
+// Must be called with the writer lock held, before the slot's write begins, so readers are
+// never kept waiting on it. Finds room for _Length bytes: the slot's own space, or new space
+// taken from the overflow area. Only the area's header changes here; the slot is pointed at
+// the space inside its write. Returns 0, or -1 if there is no room.
+static int store_reserve(const StoreSlot* _Slot, size_t _Length, uint32_t* _Offset, uint32_t* _Capacity) {
+    *(_Offset) = _Slot->json_offset;
+    *(_Capacity) = _Slot->json_capacity;
+    if(_Length <= _Slot->json_capacity)
+        return 0;
+
+    // Documents of one city barely change in size; some slack avoids moving on every write
+    size_t capacity = (_Length + _Length / 4 + 255) & ~(size_t)255;
+    uint32_t used = header->overflow_used;
+    if(capacity > STORE_OVERFLOW_SIZE - used)
+        return -1;
+
+    header->overflow_used = used + (uint32_t)capacity;
+    *(_Offset) = used;
+    *(_Capacity) = (uint32_t)capacity;
+    return 0;
+}
+
+// Must be called with the writer lock held
+static void store_write_record(int _Id, const Record* _Record, const char* _Json, size_t _JsonLength) {
+    StoreSlot* slot = &slots[_Id];
+    uint32_t offset;
+    uint32_t capacity;
+    if(_Json == NULL || _JsonLength > UINT32_MAX || store_reserve(slot, _JsonLength, &offset, &capacity) != 0)
+        _JsonLength = 0;
+
+    store_begin_write(slot);
+    if(_JsonLength > 0) {
+        slot->json_offset = offset;
+        slot->json_capacity = capacity;
+        memcpy(overflow + slot->json_offset, _Json, _JsonLength);
+    }
+    record_encode(_Record, (uint32_t)_JsonLength, &slot->record);
+    slot->flags |= STORE_SLOT_RECORD | STORE_SLOT_WRITTEN;
+    store_update_expiry(_Id);
+    store_end_write(slot);
+}
+
+// Must be called with the writer lock held
+static void store_write_validation(int _Id, const HttpValidators* _Validators, time_t _Validated) {
+    StoreSlot* slot = &slots[_Id];
+    store_begin_write(slot);
+    if(_Validators != NULL) {
+        snprintf(slot->etag, sizeof(slot->etag), "%s", _Validators->etag);
+        snprintf(slot->last_modified, sizeof(slot->last_modified), "%s", _Validators->last_modified);
+    }
+    slot->validated = _Validated;
+    store_update_expiry(_Id);
+    store_end_write(slot);
+}
+
+int store_write(int _Id, const Record* _Record, const char* _Json, size_t _JsonLength) {
+    if(_Record == NULL || !store_valid_id(_Id) || slots[_Id].name[0] == '\0')
+        return -1;
+
+    store_lock_writers();
+    store_write_record(_Id, _Record, _Json, _JsonLength);
+    store_unlock_writers();
+
+    return 0;
+}
+
+int store_import(int _Id, const Record* _Record, const char* _Json, size_t _JsonLength,
+                 const HttpValidators* _Validators, time_t _Validated) {
+    if(_Record == NULL || _Validators == NULL || !store_valid_id(_Id) || slots[_Id].name[0] == '\0')
+        return -1;
+
+    store_lock_writers();
+    int imported = !(slots[_Id].flags & STORE_SLOT_WRITTEN);
+    if(imported) {
+        store_write_record(_Id, _Record, _Json, _JsonLength);
+        store_write_validation(_Id, _Validators, _Validated);
+    }
+    store_unlock_writers();
+
+    return imported ? 0 : 1;
+}
+
+int store_write_validators(int _Id, const HttpValidators* _Validators, time_t _Validated) {
+    if(_Validators == NULL || !store_valid_id(_Id) || slots[_Id].name[0] == '\0')
+        return -1;
+
+    store_lock_writers();
+    store_write_validation(_Id, _Validators, _Validated);
+    store_unlock_writers();
+
+    return 0;
+}
+
+int store_touch(int _Id, time_t _Validated) {
+    if(!store_valid_id(_Id) || slots[_Id].name[0] == '\0')
+        return -1;
+
+    store_lock_writers();
+    store_write_validation(_Id, NULL, _Validated);
+    store_unlock_writers();
+
+    return 0;
+}
+
+time_t store_expiry(int _Id) {
+    if(!store_valid_id(_Id))
+        return 0;
+
+    return (time_t)__atomic_load_n(&expiry_index[_Id], __ATOMIC_ACQUIRE);
+}
+
+int store_expired(time_t _Now, int* _Ids, int _Capacity) {
+    if(_Ids == NULL || _Capacity <= 0 || !store_ready())
+        return 0;
+
+    int count = 0;
+    for(int i = 0; i < STORE_SLOTS && count < _Capacity; i++) {
+        int64_t expiry = __atomic_load_n(&expiry_index[i], __ATOMIC_ACQUIRE);
+        if(expiry != 0 && _Now > expiry)
+            _Ids[count++] = i;
+    }
+
+    return count;
+}
@@ -0,0 +1,77 @@
+#ifndef Store_h__
+#define Store_h__
+
+#include <stddef.h>
+#include <time.h>
+
+#include "record.h"
+#include "http.h"
+
+/*
+ * One memory-mapped cache store (cache/store.bin) for every city instead of a file per city.
+ * A fixed slot table holds each city's record, validators and validation time; an overflow
+ * area after it holds the raw upstream documents that are kept. A city's slot index is its ID
+ * for as long as the store exists, so reading an entry is a copy out of the mapping.
+ *
+ * An expiry index in front of the slot table holds, per ID, when the entry goes stale (the
+ * record's expiry, record.h). It is updated with every write, so asking whether an entry is
+ * stale is one read of that array, without copying or decoding the slot.
+ *
+ * Each slot has a sequence number that is odd while a writer is inside. Readers copy the slot
+ * and retry if the number was odd or changed meanwhile, so they never see a torn record and
+ * never block a writer. Writers (in this or another process) take a lock on the file, then
+ * move the number from even to odd; overflow space is reserved before that, so nothing
+ * inside a write waits. A slot left odd by a writer that died is reset by the next writer,
+ * which drops the record it may have torn.
+ *
+ * Slots are never freed and nothing is evicted: the table holds STORE_SLOTS cities for the
+ * life of the file, and overflow space moved away from is not reused. Once either runs out,
+ * new cities are not cached and documents are not kept; deleting the file starts over.
+ */
+
+#define STORE_PATH "cache/store.bin"
+#define STORE_SLOTS 256
+#define STORE_OVERFLOW_SIZE (1 << 20) // bytes for raw documents; what does not fit is not kept
+#define STORE_SPIN_LIMIT 100000 // retries before a reader gives up on a slot a writer is inside
+
+typedef struct {
+    int has_record; // 0 while only validators (or nothing) have been written
+    Record record;
+    time_t validated; // last time upstream confirmed the entry, 0 if never
+    HttpValidators validators;
+    size_t json_length; // kept upstream document, 0 if none
+} StoreEntry;
+
+// Maps _Path (created if missing) as the store; the default one is opened on first use.
+// Returns 0, or -1 if it could not be mapped, in which case nothing is cached.
+int store_open(const char* _Path);
+void store_close();
+
+// The ID of _Name, or -1 if it has no slot
+int store_find(const char* _Name);
+// The ID of _Name, claiming a free slot for it if needed; -1 if the table is full
+int store_claim(const char* _Name);
+
+// Returns 0, or -1 if the ID is not in use
+int store_read(int _Id, StoreEntry* _Entry);
+// Copies the kept document (not terminated) and returns its length, -1 if there is none or
+// it does not fit in _Size
+int store_read_json(int _Id, char* _Buffer, size_t _Size);
+
+// Replaces the record and kept document (_Json may be NULL); validators stay as they are
+int store_write(int _Id, const Record* _Record, const char* _Json, size_t _JsonLength);
+// Writes an entry carried over from before the store, unless the slot has ever had a record.
+// Returns 0 if it was written, 1 if the slot was left as it is, -1 on error.
+int store_import(int _Id, const Record* _Record, const char* _Json, size_t _JsonLength,
+                 const HttpValidators* _Validators, time_t _Validated);
+int store_write_validators(int _Id, const HttpValidators* _Validators, time_t _Validated);
+// Upstream confirmed the entry without sending it again (304)
+int store_touch(int _Id, time_t _Validated);
+
+// When the entry goes stale (epoch seconds), 0 if it has no record with a usable time
+time_t store_expiry(int _Id);
+// Writes the IDs of entries that are stale at _Now to _Ids and returns how many; entries
+// without a usable time are not included
+int store_expired(time_t _Now, int* _Ids, int _Capacity);
+
+#endif // Store_h__
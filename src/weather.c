@@ -5,73 +5,296 @@
 #define _GNU_SOURCE
 
 #include "weather.h"
+#include "store.h"
+#include "request.h"
 #include "jansson/jansson.h"
 #include <time.h>
 #include <string.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/stat.h>
+
+/* Raw upstream documents are only kept in the store when asked for */
+static int keep_json = 0;
+
+void jansson_weather_keep_json(int keep) {
+  keep_json = keep;
+}
+
+int jansson_weather_register_fields(void) {
+  int result = 0;
+  for (int i = 0; i < Record_Field_Count; i++) {
+    if (request_register(Request_Section_Current, record_field_name((Record_Field)i)) < 0)
+      result = -1;
+  }
+  return result;
+}
+
+/* Reads cache/<name>.meta as written before the store: validators, and its mtime as the
+   time upstream last confirmed the entry */
+static void jansson_weather_read_meta(char *cityName, HttpValidators *validators, time_t *validated) {
+  memset(validators, 0, sizeof(*validators));
+  *validated = 0;
+
+  char metaFile[64];
+  snprintf(metaFile, sizeof(metaFile), "cache/%s.meta", cityName);
+
+  struct stat st;
+  if (stat(metaFile, &st) == 0) {
+    *validated = st.st_mtime;
+  }
+
+  FILE *file = fopen(metaFile, "r");
+  if (!file) {
+    return;
+  }
+
+  if (fgets(validators->etag, sizeof(validators->etag), file)) {
+    validators->etag[strcspn(validators->etag, "\r\n")] = '\0';
+  }
+  if (fgets(validators->last_modified, sizeof(validators->last_modified), file)) {
+    validators->last_modified[strcspn(validators->last_modified, "\r\n")] = '\0';
+  }
+
+  fclose(file);
+}
+
+/* Reads cache/<name>.rec or cache/<name>.json, the files used before the store. *json gets
+   the upstream document if it was kept (or keep_json asks for it), to be freed by the caller. */
+static int jansson_weather_read_file(char *cityName, Record *record, char **json, size_t *jsonLength) {
+  *json = NULL;
+  *jsonLength = 0;
 
-int jansson_weather_exists(char *cityName) {
   char cityFile[55];
+  snprintf(cityFile, sizeof(cityFile), "cache/%s.rec", cityName);
+
+  int fd = open(cityFile, O_RDONLY);
+  if (fd >= 0) {
+    RecordFile file;
+    int result = -1;
+    if (pread(fd, &file, sizeof(file), 0) == (ssize_t)sizeof(file) &&
+        record_decode(&file, record) == 0) {
+      result = 0;
+      if (file.json_length > 0 && (*json = malloc(file.json_length)) != NULL) {
+        if (pread(fd, *json, file.json_length, sizeof(file)) == (ssize_t)file.json_length) {
+          *jsonLength = file.json_length;
+        } else {
+          free(*json);
+          *json = NULL;
+        }
+      }
+    }
+    close(fd);
+    return result;
+  }
+
   snprintf(cityFile, sizeof(cityFile), "cache/%s.json", cityName);
 
   json_error_t error;
   json_t *root = json_load_file(cityFile, 0, &error);
   if (!root) {
-    return 1; /* Staden finns inte lokalt */
+    return -1;
   }
 
+  record_from_json(root, record);
+  if (keep_json && (*json = json_dumps(root, JSON_COMPACT)) != NULL) {
+    *jsonLength = strlen(*json);
+  }
   json_decref(root);
-  return 0; /* Staden finns lokalt */
+  return 0;
 }
 
-int jansson_weather_is_stale(char *cityName) {
-  char cityFile[55];
-  snprintf(cityFile, sizeof(cityFile), "cache/%s.json", cityName);
+/* Moves an entry kept in files before the store existed into it. Only a slot without a
+   record takes it, so a newer entry written meanwhile is never replaced by the old files */
+static int jansson_weather_import(char *cityName, StoreEntry *stored) {
+  Record record;
+  char *json;
+  size_t jsonLength;
+  if (jansson_weather_read_file(cityName, &record, &json, &jsonLength) != 0) {
+    return -1;
+  }
 
-  json_error_t error;
-  json_t *root = json_load_file(cityFile, 0, &error);
+  HttpValidators validators;
+  time_t validated;
+  jansson_weather_read_meta(cityName, &validators, &validated);
 
-  json_t *current_weather = json_object_get(root, "current_weather");
-  if (!json_is_object(current_weather)) {
-    json_decref(root);
-    return -1;
+  int id = store_claim(cityName);
+  int result = -1;
+  if (id >= 0 && store_import(id, &record, json, jsonLength, &validators, validated) >= 0 &&
+      store_read(id, stored) == 0 && stored->has_record) {
+    result = 0;
   }
 
-  json_t *time_val = json_object_get(current_weather, "time");
-  if (!json_is_string(time_val)) {
-    json_decref(root);
+  free(json);
+  return result;
+}
+
+/* The stored entry for cityName, imported from the old files if it has none yet. A slot that
+   cannot be read right now (a writer is inside) counts as missing without importing. */
+static int jansson_weather_lookup(char *cityName, StoreEntry *stored) {
+  int id = store_find(cityName);
+  if (id >= 0) {
+    if (store_read(id, stored) != 0) {
+      return -1;
+    }
+    if (stored->has_record) {
+      return 0;
+    }
+  }
+
+  return jansson_weather_import(cityName, stored);
+}
+
+int jansson_weather_open(char *cityName, weather_entry *entry) {
+  memset(entry, 0, sizeof(weather_entry));
+  snprintf(entry->cityName, sizeof(entry->cityName), "%s", cityName);
+
+  StoreEntry stored;
+  if (jansson_weather_lookup(cityName, &stored) != 0) {
+    return 1;
+  }
+
+  entry->found = 1;
+  entry->record = stored.record;
+  entry->validated = stored.validated;
+  return 0;
+}
+
+int jansson_weather_entry_exists(const weather_entry *entry) {
+  return entry->found ? 0 : 1; /* 0: staden finns lokalt, 1: finns inte */
+}
+
+int jansson_weather_entry_is_stale(const weather_entry *entry) {
+  if (!entry->found) {
     return -1;
   }
-  const char *time_str = json_string_value(time_val);
 
-  struct tm tm_time = {0};
-  if (strptime(time_str, "%Y-%m-%dT%H:%M", &tm_time) == 0) {
-    fprintf(stderr, "Failed to parse time string: %s\n", time_str);
-    json_decref(root);
+  return record_is_stale(&entry->record, entry->validated, time(NULL));
+}
+
+int jansson_weather_entry_age(const weather_entry *entry) {
+  if (!entry->found || entry->record.observed == 0) {
     return -1;
   }
 
-  time_t weather_time = timegm(&tm_time);
-  time_t now = time(NULL);
+  time_t since = entry->record.observed;
+  if (entry->validated > since) {
+    since = entry->validated;
+  }
 
-  json_t *interval_val = json_object_get(current_weather, "interval");
-  int interval = (json_is_integer(interval_val))
-                     ? (int)json_integer_value(interval_val)
-                     : 900;
+  double age = difftime(time(NULL), since);
+  return age > 0 ? (int)age : 0;
+}
 
-  double diff = difftime(now, weather_time);
+int jansson_weather_entry_staleness(const weather_entry *entry) {
+  time_t expiry = entry->found ? record_expiry(&entry->record, entry->validated) : 0;
+  if (expiry == 0) {
+    return -1;
+  }
+
+  double staleness = difftime(time(NULL), expiry);
+  return staleness > 0 ? (int)staleness : 0;
+}
 
-  if (diff > interval) {
-    json_decref(root);
-    return 0; /* Vädret är gammalt */
+int jansson_weather_entry_get(const weather_entry *entry, Record_Field field, double *value) {
+  if (!entry->found) {
+    return -1;
   }
 
+  return record_get(&entry->record, field, value);
+}
+
+void jansson_weather_entry_replace(weather_entry *entry, json_t *root) {
+  entry->found = root != NULL;
+  record_from_json(root, &entry->record);
+  entry->validated = time(NULL); /* it just came from upstream */
   json_decref(root);
-  return 1; /* Vädret är inte gammalt */
+}
+
+void jansson_weather_close(weather_entry *entry) {
+  entry->found = 0;
+}
+
+int jansson_weather_exists(char *cityName) {
+  weather_entry entry;
+  jansson_weather_open(cityName, &entry);
+  int result = jansson_weather_entry_exists(&entry);
+  jansson_weather_close(&entry);
+  return result;
+}
+
+time_t jansson_weather_expiry(char *cityName) {
+  int id = store_find(cityName);
+  return id >= 0 ? store_expiry(id) : 0;
+}
+
+int jansson_weather_is_stale(char *cityName) {
+  /* One read of the expiry index for anything already in the store */
+  time_t expiry = jansson_weather_expiry(cityName);
+  if (expiry != 0) {
+    return time(NULL) > expiry ? 1 : 0;
+  }
+
+  weather_entry entry;
+  jansson_weather_open(cityName, &entry);
+  int result = jansson_weather_entry_is_stale(&entry);
+  jansson_weather_close(&entry);
+  return result;
+}
+
+/* Writes an already parsed document, e.g. one from http_fetch_json, to the store */
+int jansson_weather_write_json(char *cityName, json_t *root) {
+  if (root == NULL) {
+    return -1;
+  }
+
+  Record record;
+  record_from_json(root, &record);
+
+  int id = store_claim(cityName);
+  if (id < 0) {
+    return -1;
+  }
+
+  char *json = keep_json ? json_dumps(root, JSON_COMPACT) : NULL;
+  int result = store_write(id, &record, json, json ? strlen(json) : 0);
+  free(json);
+
+  if (result != 0) {
+    fprintf(stderr, "Error writing cache entry: %s\n", cityName);
+  }
+  return result;
+}
+
+/* The cached document as JSON: the upstream original if it was kept, otherwise the
+   "current" section rebuilt from the record. NULL if nothing is cached. */
+json_t *jansson_weather_export_json(char *cityName) {
+  StoreEntry stored;
+  if (jansson_weather_lookup(cityName, &stored) != 0) {
+    return NULL;
+  }
+
+  if (stored.json_length > 0) {
+    char *json = malloc(stored.json_length);
+    int length = json ? store_read_json(store_find(cityName), json, stored.json_length) : -1;
+
+    json_error_t error;
+    json_t *root = length > 0 ? json_loadb(json, length, 0, &error) : NULL;
+    free(json);
+    if (root != NULL) {
+      return root;
+    }
+  }
+
+  return record_to_json(&stored.record);
 }
 
 int jansson_weather_write(char *cityName, const char *data) {
-  char cityFile[55];
-  snprintf(cityFile, sizeof(cityFile), "cache/%s.json", cityName);
+  if (data == NULL) {
+    return -1;
+  }
 
   json_error_t error;
   json_t *root = json_loads(data, 0, &error);
@@ -81,144 +304,166 @@ int jansson_weather_write(char *cityName, const char *data) {
     return -1;
   }
 
-  if (json_dump_file(root, cityFile, JSON_INDENT(2)) != 0) {
-    fprintf(stderr, "Error writing JSON to file: %s\n", cityFile);
-    json_decref(root);
+  int result = jansson_weather_write_json(cityName, root);
+  json_decref(root);
+  return result;
+}
+
+/* Splits the array returned for a multi-coordinate request into one cache entry
+   per city. cityNames must be in the same order as the coordinates were sent. */
+int jansson_weather_write_batch(char **cityNames, int count, const char *data) {
+  if (data == NULL || count <= 0) {
+    return -1;
+  }
+
+  json_error_t error;
+  json_t *root = json_loads(data, 0, &error);
+  if (!root) {
+    fprintf(stderr, "Error parsing JSON data: %s (line %d, col %d)\n", error.text,
+            error.line, error.column);
     return -1;
   }
 
+  int failed = 0;
+  if (json_is_array(root) && (int)json_array_size(root) == count) {
+    for (int i = 0; i < count; i++) {
+      if (jansson_weather_write_json(cityNames[i], json_array_get(root, i)) != 0) {
+        failed++;
+      }
+    }
+  } else if (json_is_object(root) && count == 1) {
+    /* A single coordinate is answered with a plain object */
+    failed = jansson_weather_write_json(cityNames[0], root) != 0;
+  } else {
+    fprintf(stderr, "Unexpected batch response for %d cities\n", count);
+    failed = count;
+  }
+
   json_decref(root);
+  return failed;
+}
+
+int jansson_weather_read_validators(char *cityName, HttpValidators *validators) {
+  memset(validators, 0, sizeof(*validators));
+
+  StoreEntry stored;
+  if (jansson_weather_lookup(cityName, &stored) != 0) {
+    return -1;
+  }
+
+  *validators = stored.validators;
   return 0;
 }
 
-int jansson_weather_print(char *cityName, int parameter) {
-  char cityFile[55];
-  snprintf(cityFile, sizeof(cityFile), "cache/%s.json", cityName);
+int jansson_weather_write_validators(char *cityName, const HttpValidators *validators) {
+  int id = store_claim(cityName);
+  if (id < 0 || store_write_validators(id, validators, time(NULL)) != 0) {
+    fprintf(stderr, "Error writing validators: %s\n", cityName);
+    return -1;
+  }
 
-  json_error_t error;
-  json_t *root = json_load_file(cityFile, 0, &error);
-  if (!root) {
-    fprintf(stderr, "Error loading JSON: %s (line %d, col %d)\n", error.text,
-            error.line, error.column);
+  return 0;
+}
+
+/* Marks the entry as current after a 304, without touching the cached document */
+int jansson_weather_touch(char *cityName) {
+  int id = store_claim(cityName);
+  if (id < 0) {
     return -1;
   }
 
-  json_t *current_weather = json_object_get(root, "current");
-  if (!json_is_object(current_weather)) {
-    json_decref(root);
+  return store_touch(id, time(NULL));
+}
+
+int jansson_weather_entry_print(const weather_entry *entry, int parameter) {
+  if (!entry->found) {
+    fprintf(stderr, "No cached weather for %s\n", entry->cityName);
     return -1;
   }
 
+  const Record *record = &entry->record;
+  double value;
   switch (parameter) {
-    case 1: { // Time
-      json_t *time_val = json_object_get(current_weather, "time");
-      if (json_is_string(time_val)) {
-        printf("Time: %s\n", json_string_value(time_val));
+    case 1: // Time
+      if (record->time[0] != '\0') {
+        printf("Time: %s\n", record->time);
       }
       break;
-    }
-    case 2: { // Interval
-      json_t *interval_val = json_object_get(current_weather, "interval");
-      if (json_is_integer(interval_val)) {
-        printf("Interval: %d seconds\n", (int)json_integer_value(interval_val));
+    case 2: // Interval
+      if (record->interval > 0) {
+        printf("Interval: %d seconds\n", record->interval);
       }
       break;
-    }
-    case 3: { // Temperature
-      json_t *temp_val = json_object_get(current_weather, "temperature_2m");
-      if (json_is_number(temp_val)) {
-        printf("Temperature: %.2f °C\n", json_number_value(temp_val));
+    case 3: // Temperature
+      if (record_get(record, Record_Field_Temperature2m, &value) == 0) {
+        printf("Temperature: %.2f °C\n", value);
       }
       break;
-    }
-    case 4: { // Windspeed
-      json_t *wind_val = json_object_get(current_weather, "windspeed");
-      if (json_is_number(wind_val)) {
-        printf("Windspeed: %.2f km/h\n", json_number_value(wind_val));
+    case 4: // Windspeed
+      if (record_get(record, Record_Field_WindSpeed10m, &value) == 0) {
+        printf("Windspeed: %.2f km/h\n", value);
       }
       break;
-    }
-    case 5: { // Winddirection
-      json_t *winddir_val = json_object_get(current_weather, "winddirection");
-      if (json_is_integer(winddir_val)) {
-        printf("Winddirection: %d°\n", (int)json_integer_value(winddir_val));
+    case 5: // Winddirection
+      if (record_get(record, Record_Field_WindDirection10m, &value) == 0) {
+        printf("Winddirection: %d°\n", (int)value);
       }
       break;
-    }
-    case 6: { // Is_day
-      json_t *isday_val = json_object_get(current_weather, "is_day");
-      if (json_is_integer(isday_val)) {
-        printf("Is day: %s\n", (int)json_integer_value(isday_val) ? "Yes" : "No");
+    case 6: // Is_day
+      if (record_get(record, Record_Field_IsDay, &value) == 0) {
+        printf("Is day: %s\n", (int)value ? "Yes" : "No");
       }
       break;
-    }
-    case 7: { // Weathercode
-      json_t *wcode_val = json_object_get(current_weather, "weathercode");
-      if (json_is_integer(wcode_val)) {
-        printf("Weathercode: %d\n", (int)json_integer_value(wcode_val));
+    case 7: // Weathercode
+      if (record_get(record, Record_Field_WeatherCode, &value) == 0) {
+        printf("Weathercode: %d\n", (int)value);
       }
       break;
-    }
     default:
       break;
   }
 
-  json_decref(root);
   return 0;
 }
 
+int jansson_weather_print(char *cityName, int parameter) {
+  weather_entry entry;
+  jansson_weather_open(cityName, &entry);
+  int result = jansson_weather_entry_print(&entry, parameter);
+  jansson_weather_close(&entry);
+  return result;
+}
+
 current_weather jansson_weather_fetch(char *cityName) {
   current_weather cw = {0}; // initialize all fields to safe defaults
 
-  char cityFile[55];
-  snprintf(cityFile, sizeof(cityFile), "cache/%s.json", cityName);
-
-  json_error_t error;
-  json_t *root = json_load_file(cityFile, 0, &error);
-  if (!root) {
-    fprintf(stderr, "Error loading JSON: %s (line %d, col %d)\n", error.text,
-            error.line, error.column);
-    return cw; // return empty struct on error
+  weather_entry entry;
+  if (jansson_weather_open(cityName, &entry) != 0) {
+    return cw; // return empty struct if there is no entry
   }
 
-  json_t *current_weather = json_object_get(root, "current_weather");
-  if (!json_is_object(current_weather)) {
-    json_decref(root);
-    return cw; // return empty struct if missing
-  }
+  const Record *record = &entry.record;
+  snprintf(cw.time, sizeof(cw.time), "%s", record->time);
+  cw.interval = record->interval;
 
-  // Extract values
-  json_t *time_val = json_object_get(current_weather, "time");
-  json_t *interval_val = json_object_get(current_weather, "interval");
-  json_t *temp_val = json_object_get(current_weather, "temperature");
-  json_t *wind_val = json_object_get(current_weather, "windspeed");
-  json_t *winddir_val = json_object_get(current_weather, "winddirection");
-  json_t *isday_val = json_object_get(current_weather, "is_day");
-  json_t *wcode_val = json_object_get(current_weather, "weathercode");
-
-  if (json_is_string(time_val)) {
-    strncpy(cw.time, json_string_value(time_val), sizeof(cw.time) - 1);
-  }
-  if (json_is_integer(interval_val)) {
-    cw.interval = (int)json_integer_value(interval_val);
+  double value;
+  if (record_get(record, Record_Field_Temperature2m, &value) == 0) {
+    cw.temperature = value;
   }
-  if (json_is_number(temp_val)) {
-    cw.temperature = json_number_value(temp_val);
+  if (record_get(record, Record_Field_WindSpeed10m, &value) == 0) {
+    cw.windspeed = value;
   }
-  if (json_is_number(wind_val)) {
-    cw.windspeed = json_number_value(wind_val);
+  if (record_get(record, Record_Field_WindDirection10m, &value) == 0) {
+    cw.winddirection = (int)value;
   }
-  if (json_is_integer(winddir_val)) {
-    cw.winddirection = (int)json_integer_value(winddir_val);
+  if (record_get(record, Record_Field_IsDay, &value) == 0) {
+    cw.is_day = (int)value;
   }
-  if (json_is_integer(isday_val)) {
-    cw.is_day = (int)json_integer_value(isday_val);
-  }
-  if (json_is_integer(wcode_val)) {
-    cw.weathercode = (int)json_integer_value(wcode_val);
+  if (record_get(record, Record_Field_WeatherCode, &value) == 0) {
+    cw.weathercode = (int)value;
   }
 
-  json_decref(root);
+  jansson_weather_close(&entry);
   return cw;
 }
 
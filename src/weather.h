@@ -3,9 +3,27 @@
 
 #define weather_exists jansson_weather_exists
 #define weather_is_stale jansson_weather_is_stale
+#define weather_expiry jansson_weather_expiry
 #define weather_write jansson_weather_write
+#define weather_write_batch jansson_weather_write_batch
+#define weather_write_json jansson_weather_write_json
+#define weather_read_validators jansson_weather_read_validators
+#define weather_write_validators jansson_weather_write_validators
+#define weather_touch jansson_weather_touch
 #define weather_print jansson_weather_print
 #define weather_fetch jansson_weather_fetch
+#define weather_keep_json jansson_weather_keep_json
+#define weather_register_fields jansson_weather_register_fields
+#define weather_export_json jansson_weather_export_json
+#define weather_open jansson_weather_open
+#define weather_entry_exists jansson_weather_entry_exists
+#define weather_entry_is_stale jansson_weather_entry_is_stale
+#define weather_entry_get jansson_weather_entry_get
+#define weather_entry_age jansson_weather_entry_age
+#define weather_entry_staleness jansson_weather_entry_staleness
+#define weather_entry_print jansson_weather_entry_print
+#define weather_entry_replace jansson_weather_entry_replace
+#define weather_close jansson_weather_close
 
 typedef struct {
   char time[32]; /* todo how long can a ISO 8601 time string be? 32 might be to small */
@@ -18,10 +36,55 @@ typedef struct {
 } current_weather;
 
 // Jansson:
+#include <time.h>
+#include "jansson/jansson.h"
+#include "http.h"
+#include "record.h"
+
+/* A cache entry looked up once, to be queried any number of times */
+typedef struct {
+  char cityName[64];
+  int found;        /* 0 when there is no usable entry */
+  Record record;
+  time_t validated; /* last time upstream confirmed the entry, 0 if never */
+} weather_entry;
+
 int jansson_weather_exists(char *cityName);
 int jansson_weather_is_stale(char *cityName);
+/* When the entry goes stale (epoch seconds), 0 if it is not in the store */
+time_t jansson_weather_expiry(char *cityName);
 int jansson_weather_write(char *cityName, const char *data);
+int jansson_weather_write_batch(char **cityNames, int count, const char *data);
+int jansson_weather_write_json(char *cityName, json_t *root);
+/* Entries are binary records (record.h) in the cache store (store.h); keep != 0 stores the
+   upstream document with them so export_json returns it unchanged instead of a rebuilt
+   "current" section */
+void jansson_weather_keep_json(int keep);
+/* Registers every "current" variable a record stores (record.h) with the URL builder, so
+   entries are complete whichever of them is shown. Returns 0, or -1 if one was refused */
+int jansson_weather_register_fields(void);
+json_t *jansson_weather_export_json(char *cityName);
+/* Validators are stored with the entry, along with when upstream last confirmed it */
+int jansson_weather_read_validators(char *cityName, HttpValidators *validators);
+int jansson_weather_write_validators(char *cityName, const HttpValidators *validators);
+int jansson_weather_touch(char *cityName);
 int jansson_weather_print(char *cityName, int parameter);
 current_weather jansson_weather_fetch(char *cityName);
 
+/* Entry handles: one lookup (a copy out of the cache store) instead of one per query.
+   The queries return the same values as the by-name functions above. */
+int jansson_weather_open(char *cityName, weather_entry *entry);
+int jansson_weather_entry_exists(const weather_entry *entry);
+int jansson_weather_entry_is_stale(const weather_entry *entry);
+/* Seconds since upstream last confirmed the entry (observed or revalidated), -1 if unknown */
+int jansson_weather_entry_age(const weather_entry *entry);
+/* Seconds the entry has been stale, 0 while it is fresh, -1 if unknown */
+int jansson_weather_entry_staleness(const weather_entry *entry);
+/* Any variable of the "current" section; 0 and *value set, or -1 if it was not sent */
+int jansson_weather_entry_get(const weather_entry *entry, Record_Field field, double *value);
+int jansson_weather_entry_print(const weather_entry *entry, int parameter);
+/* Takes over root (e.g. a freshly fetched document) in place of what was looked up; releases it */
+void jansson_weather_entry_replace(weather_entry *entry, json_t *root);
+void jansson_weather_close(weather_entry *entry);
+
 #endif
\ No newline at end of file
@@ -0,0 +1,287 @@
+#define _POSIX_C_SOURCE 200809L
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include "http.h"
+#include "engine.h"
+#include "hedge.h"
+
+/*
+ * Per-fetch latency of a cold easy handle (new handle, new connection, new TLS
+ * handshake every time) against the pooled handles used by http_fetch(), then the pooled
+ * fetches again with hedging at its default percentile and budget (most telling against a
+ * stand-in started with -latency lognormal:MEDIAN:SIGMA). Then
+ * throughput and latency of in-flight concurrent transfers over an HTTP/1.1
+ * keep-alive pool against the multiplexed HTTP/2 mode, and the same load through the
+ * epoll fetch engine (engine.h) that refresh_cities uses.
+ *
+ *   ./http_bench [base-url] [iterations] [ca-file] [in-flight]
+ *   e.g. ./http_bench https://localhost:8443 200 cert.pem 32   (against ./standin)
+ *
+ * The multiplexed run only reports numbers when the server negotiated HTTP/2, which the
+ * stand-in does when built with HTTP2=1 and started with -http2 1:
+ *   ./standin -p 8444 -cert cert.pem -key key.pem -http2 1
+ *   ./http_bench https://localhost:8444 2000 cert.pem 64
+ */
+
+static double now_ms() {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1000.0 + ts.tv_nsec / 1000000.0;
+}
+
+static size_t discard(void *contents, size_t size, size_t nmemb, void *userp) {
+    (void)contents;
+    *(size_t*)userp += size * nmemb;
+    return size * nmemb;
+}
+
+static int compare_double(const void* a, const void* b) {
+    double x = *(const double*)a, y = *(const double*)b;
+    return (x > y) - (x < y);
+}
+
+static void report(const char* name, double* samples, int count) {
+    double total = 0;
+    for(int i = 0; i < count; i++)
+        total += samples[i];
+    qsort(samples, count, sizeof(double), compare_double);
+    printf("%-8s n=%d  avg=%.3f ms  p50=%.3f ms  p99=%.3f ms  max=%.3f ms\n", name, count,
+           total / count, samples[count / 2], samples[(int)(count * 0.99)], samples[count - 1]);
+}
+
+static const char* version_name(long version) {
+    switch(version) {
+        case CURL_HTTP_VERSION_1_0: return "HTTP/1.0";
+        case CURL_HTTP_VERSION_1_1: return "HTTP/1.1";
+        case CURL_HTTP_VERSION_2_0: return "HTTP/2";
+        default: return "?";
+    }
+}
+
+static int start_transfer(CURLM* multi, const char* url, size_t* received, double* startedAt) {
+    CURL* curl_handle = http_acquire_handle();
+    if(curl_handle == NULL)
+        return -1;
+    curl_easy_setopt(curl_handle, CURLOPT_URL, url);
+    curl_easy_setopt(curl_handle, CURLOPT_WRITEFUNCTION, discard);
+    curl_easy_setopt(curl_handle, CURLOPT_WRITEDATA, received);
+    curl_easy_setopt(curl_handle, CURLOPT_PRIVATE, (void*)startedAt);
+    *startedAt = now_ms();
+    return curl_multi_add_handle(multi, curl_handle) == CURLM_OK ? 0 : -1;
+}
+
+// Keeps inFlight transfers running until iterations have completed; each sample runs from
+// adding the transfer to its completion, so time spent waiting for a connection counts
+static int concurrent_run(const char* name, int multiplex, const char* url, int iterations, int inFlight, double* samples) {
+    // Fresh share per mode so neither inherits the other's connections
+    http_cleanup();
+    http_init();
+    http_set_multiplex(multiplex);
+
+    CURLM* multi = curl_multi_init();
+    double* started = malloc(sizeof(double) * iterations);
+    if(multi == NULL || started == NULL)
+        return -1;
+    http_configure_multi(multi);
+
+    size_t received = 0;
+    int submitted = 0, completed = 0, failed = 0, running = 0;
+    long version = 0;
+    double start = now_ms();
+
+    while(completed < iterations) {
+        while(submitted < iterations && submitted - completed < inFlight) {
+            if(start_transfer(multi, url, &received, &started[submitted]) != 0)
+                return -1;
+            submitted++;
+        }
+
+        curl_multi_perform(multi, &running);
+
+        int before = completed;
+        CURLMsg* message;
+        int remaining;
+        while((message = curl_multi_info_read(multi, &remaining)) != NULL) {
+            if(message->msg != CURLMSG_DONE)
+                continue;
+            double* startedAt = NULL;
+            long code = 0;
+            curl_easy_getinfo(message->easy_handle, CURLINFO_PRIVATE, (char**)&startedAt);
+            curl_easy_getinfo(message->easy_handle, CURLINFO_RESPONSE_CODE, &code);
+            curl_easy_getinfo(message->easy_handle, CURLINFO_HTTP_VERSION, &version);
+            if(message->data.result != CURLE_OK || code != 200)
+                failed++;
+            samples[completed++] = now_ms() - *startedAt;
+            curl_multi_remove_handle(multi, message->easy_handle);
+            http_release_handle(message->easy_handle);
+        }
+
+        // Refill the freed slots before waiting again
+        if(completed == before)
+            curl_multi_poll(multi, NULL, 0, 1000, NULL);
+    }
+
+    double elapsed = now_ms() - start;
+    curl_multi_cleanup(multi);
+    free(started);
+
+    // A fallback run would only repeat the keep-alive numbers under another name
+    if(multiplex && version != CURL_HTTP_VERSION_2_0) {
+        printf("%-8s skipped: server negotiated %s, multiplexing not measured\n", name, version_name(version));
+        return 0;
+    }
+
+    printf("%-8s in-flight=%d  %.0f req/s  negotiated %s  failed=%d\n", name, inFlight,
+           iterations / (elapsed / 1000.0), version_name(version), failed);
+    report(name, samples, iterations);
+    return 0;
+}
+
+typedef struct {
+    double* samples;
+    double* started;
+    int completed;
+    int failed;
+} EngineRun;
+
+static void engine_done(const char* url, char* data, size_t size, long status, void* userdata) {
+    (void)url; (void)size; (void)status;
+    EngineRun* run = (EngineRun*)userdata;
+    if(data == NULL)
+        run->failed++;
+    http_free(data);
+    run->samples[run->completed] = now_ms() - run->started[run->completed];
+    run->completed++;
+}
+
+// Everything is submitted up front and the engine caps the connections at inFlight, so a
+// sample includes the time spent queued, as in concurrent_run; completions are not in
+// submission order, so latencies are paired with start times by completion rank
+static int engine_bench(const char* url, int iterations, int inFlight, double* samples) {
+    http_cleanup();
+    http_init();
+
+    FetchEngine* engine = NULL;
+    if(engine_init(&engine, inFlight) != 0)
+        return -1;
+
+    EngineRun run = { samples, malloc(sizeof(double) * iterations), 0, 0 };
+    if(run.started == NULL) {
+        engine_dispose(&engine);
+        return -1;
+    }
+
+    double start = now_ms();
+    for(int i = 0; i < iterations; i++) {
+        run.started[i] = now_ms();
+        if(engine_submit(engine, url, engine_done, &run) != 0) {
+            engine_dispose(&engine);
+            free(run.started);
+            return -1;
+        }
+    }
+    int result = engine_run(engine);
+    double elapsed = now_ms() - start;
+    engine_dispose(&engine);
+    free(run.started);
+    if(result != 0 || run.completed != iterations)
+        return -1;
+
+    printf("%-8s in-flight=%d  %.0f req/s  failed=%d\n", "engine", inFlight,
+           iterations / (elapsed / 1000.0), run.failed);
+    report("engine", samples, iterations);
+    return 0;
+}
+
+static int cold_fetch(const char* url, const char* caFile) {
+    size_t received = 0;
+    CURL* curl_handle = curl_easy_init();
+    if(curl_handle == NULL)
+        return -1;
+    curl_easy_setopt(curl_handle, CURLOPT_URL, url);
+    curl_easy_setopt(curl_handle, CURLOPT_WRITEFUNCTION, discard);
+    curl_easy_setopt(curl_handle, CURLOPT_WRITEDATA, &received);
+    if(caFile != NULL)
+        curl_easy_setopt(curl_handle, CURLOPT_CAINFO, caFile);
+    CURLcode res = curl_easy_perform(curl_handle);
+    curl_easy_cleanup(curl_handle);
+    return res == CURLE_OK ? 0 : -1;
+}
+
+int main(int argc, char** argv) {
+    const char* base = argc > 1 ? argv[1] : "https://localhost:8443";
+    int iterations = argc > 2 ? atoi(argv[2]) : 100;
+    const char* caFile = argc > 3 ? argv[3] : NULL;
+    int inFlight = argc > 4 ? atoi(argv[4]) : 16;
+    if(iterations <= 0)
+        iterations = 100;
+    if(inFlight <= 0)
+        inFlight = 16;
+
+    http_init();
+    http_set_base_url(base);
+    http_set_ca_file(caFile);
+    http_set_rate_limit(0, 0); // measure the transport, not the upstream quota
+
+    char url[512];
+    http_build_url(url, sizeof(url), 55.7047, 13.1910);
+
+    double* samples = malloc(sizeof(double) * iterations);
+    if(samples == NULL)
+        return -1;
+
+    for(int i = 0; i < iterations; i++) {
+        double start = now_ms();
+        if(cold_fetch(url, caFile) != 0) {
+            fprintf(stderr, "cold fetch failed\n");
+            return -1;
+        }
+        samples[i] = now_ms() - start;
+    }
+    report("cold", samples, iterations);
+
+    for(int i = 0; i < iterations; i++) {
+        double start = now_ms();
+        char* data = http_fetch(55.7047, 13.1910);
+        if(data == NULL) {
+            fprintf(stderr, "pooled fetch failed\n");
+            return -1;
+        }
+        samples[i] = now_ms() - start;
+        http_free(data);
+    }
+    report("pooled", samples, iterations);
+
+    // The pooled run above already filled the hedge history, so no warm-up is needed
+    http_set_hedging(HEDGE_DEFAULT_PERCENTILE, HEDGE_DEFAULT_BUDGET);
+    for(int i = 0; i < iterations; i++) {
+        double start = now_ms();
+        char* data = http_fetch(55.7047, 13.1910);
+        if(data == NULL) {
+            fprintf(stderr, "hedged fetch failed\n");
+            return -1;
+        }
+        samples[i] = now_ms() - start;
+        http_free(data);
+    }
+    report("hedged", samples, iterations);
+    http_set_hedging(0, 0);
+
+    if(concurrent_run("http/1.1", 0, url, iterations, inFlight, samples) != 0 ||
+       concurrent_run("http/2", 1, url, iterations, inFlight, samples) != 0) {
+        fprintf(stderr, "concurrent run failed\n");
+        return -1;
+    }
+
+    if(engine_bench(url, iterations, inFlight, samples) != 0) {
+        fprintf(stderr, "engine run failed\n");
+        return -1;
+    }
+
+    free(samples);
+    http_cleanup();
+    return 0;
+}
@@ -0,0 +1,726 @@
+#define _GNU_SOURCE // strcasestr, M_PI
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <strings.h>
+#include <math.h>
+#include <time.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <signal.h>
+#include <sys/socket.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <openssl/ssl.h>
+#include <openssl/err.h>
+#ifdef STANDIN_HTTP2
+#include <nghttp2/nghttp2.h>
+#endif
+
+#include "tinydir.h"
+#include "jansson/jansson.h"
+
+/*
+ * Local stand-in for the Open-Meteo forecast endpoint, for offline load testing of http.c.
+ *
+ * Serves /v1/forecast?latitude=..&longitude=.. from recorded documents: every cache/<name>.json
+ * whose city is listed in cities/ is answered for the coordinates closest to that city.
+ * Comma separated coordinate lists get a JSON array, like the real API. Responses carry an
+ * ETag and honour If-None-Match.
+ *
+ *   ./standin [-p port] [-cert cert.pem -key key.pem] [-docs cache] [-cities cities] [-seed n]
+ *             [-latency fixed:MS | uniform:MIN:MAX | exp:MEAN | lognormal:MEDIAN:SIGMA]
+ *             [-error-rate P] [-reset-rate P] [-drip BYTES:MS] [-drip-rate P] [-http2 1]
+ *
+ * -error-rate answers with 503, -reset-rate aborts the connection with a TCP RST before
+ * answering, and -drip sends the body BYTES at a time with MS between writes.
+ *
+ * -http2 1 (with -cert, in a build with STANDIN_HTTP2 defined, which links libnghttp2: make
+ * bench HTTP2=1) offers h2 by ALPN next to http/1.1, so clients that ask for it get HTTP/2 and
+ * can multiplex. The streams of one connection are answered one after another on its thread:
+ * -latency delays queue up behind each other there, and -drip is not applied.
+ */
+
+#define STANDIN_MAX_DOCUMENTS 256
+#define STANDIN_MAX_COORDINATES 128
+
+typedef enum {
+    Latency_None,
+    Latency_Fixed,
+    Latency_Uniform,
+    Latency_Exponential,
+    Latency_LogNormal
+} Latency_Kind;
+
+typedef struct {
+    char name[128];
+    double latitude;
+    double longitude;
+    char* body;
+    size_t size;
+    char etag[32];
+} Document;
+
+typedef struct {
+    int fd;
+    SSL* ssl;
+    unsigned int seed;
+#ifdef STANDIN_HTTP2
+    nghttp2_session* h2; // NULL for HTTP/1.1
+    int32_t stream_id; // the stream being answered
+#endif
+} Connection;
+
+static SSL_CTX* ssl_ctx = NULL;
+static int http2 = 0;
+
+static Document documents[STANDIN_MAX_DOCUMENTS];
+static int document_count = 0;
+
+static Latency_Kind latency_kind = Latency_None;
+static double latency_a = 0;
+static double latency_b = 0;
+static double error_rate = 0;
+static double reset_rate = 0;
+static double drip_rate = 0;
+static int drip_bytes = 0;
+static int drip_ms = 0;
+
+static int conn_read(Connection* conn, char* buffer, int size) {
+    if(conn->ssl != NULL)
+        return SSL_read(conn->ssl, buffer, size);
+    return (int)read(conn->fd, buffer, size);
+}
+
+static int conn_write(Connection* conn, const char* buffer, int size) {
+    int written = 0;
+    while(written < size) {
+        int n = conn->ssl != NULL ? SSL_write(conn->ssl, buffer + written, size - written)
+                                  : (int)write(conn->fd, buffer + written, size - written);
+        if(n <= 0)
+            return -1;
+        written += n;
+    }
+    return written;
+}
+
+static void sleep_ms(double ms) {
+    if(ms <= 0)
+        return;
+    struct timespec ts;
+    ts.tv_sec = (time_t)(ms / 1000);
+    ts.tv_nsec = (long)((ms - ts.tv_sec * 1000.0) * 1000000.0);
+    nanosleep(&ts, NULL);
+}
+
+static double random_unit(unsigned int* seed) {
+    return (rand_r(seed) + 1.0) / ((double)RAND_MAX + 2.0); // (0, 1), safe for log()
+}
+
+static double sample_latency(unsigned int* seed) {
+    switch(latency_kind) {
+        case Latency_Fixed:
+            return latency_a;
+        case Latency_Uniform:
+            return latency_a + (latency_b - latency_a) * random_unit(seed);
+        case Latency_Exponential:
+            return -latency_a * log(random_unit(seed));
+        case Latency_LogNormal: {
+            // Box-Muller for a standard normal sample
+            double z = sqrt(-2.0 * log(random_unit(seed))) * cos(2.0 * M_PI * random_unit(seed));
+            return latency_a * exp(latency_b * z);
+        }
+        default:
+            return 0;
+    }
+}
+
+static int parse_latency(const char* spec) {
+    if(sscanf(spec, "fixed:%lf", &latency_a) == 1)
+        latency_kind = Latency_Fixed;
+    else if(sscanf(spec, "uniform:%lf:%lf", &latency_a, &latency_b) == 2)
+        latency_kind = Latency_Uniform;
+    else if(sscanf(spec, "exp:%lf", &latency_a) == 1)
+        latency_kind = Latency_Exponential;
+    else if(sscanf(spec, "lognormal:%lf:%lf", &latency_a, &latency_b) == 2)
+        latency_kind = Latency_LogNormal;
+    else
+        return -1;
+    return 0;
+}
+
+static char* load_file(const char* path, size_t* size) {
+    FILE* file = fopen(path, "rb");
+    if(file == NULL)
+        return NULL;
+
+    fseek(file, 0, SEEK_END);
+    long length = ftell(file);
+    fseek(file, 0, SEEK_SET);
+
+    char* data = malloc(length + 1);
+    if(data != NULL && fread(data, 1, length, file) == (size_t)length) {
+        data[length] = '\0';
+        *size = length;
+    } else {
+        free(data);
+        data = NULL;
+    }
+
+    fclose(file);
+    return data;
+}
+
+// Pairs every city in citiesDir with its recorded document in docsDir
+static void load_documents(const char* docsDir, const char* citiesDir) {
+    tinydir_dir dir;
+    if(tinydir_open(&dir, citiesDir) == -1) {
+        fprintf(stderr, "Failed to open '%s' directory\n", citiesDir);
+        return;
+    }
+
+    while(dir.has_next && document_count < STANDIN_MAX_DOCUMENTS) {
+        tinydir_file file;
+        if(tinydir_readfile(&dir, &file) == -1)
+            break;
+        tinydir_next(&dir);
+
+        const char* ext = strrchr(file.name, '.');
+        if(file.is_dir || ext == NULL || strcmp(ext, ".json") != 0)
+            continue;
+
+        json_error_t error;
+        json_t* root = json_load_file(file.path, 0, &error);
+        json_t* jname = json_object_get(root, "name");
+        json_t* jlatitude = json_object_get(root, "latitude");
+        json_t* jlongitude = json_object_get(root, "longitude");
+        if(!json_is_string(jname) || !json_is_number(jlatitude) || !json_is_number(jlongitude)) {
+            json_decref(root);
+            continue;
+        }
+
+        Document* document = &documents[document_count];
+        snprintf(document->name, sizeof(document->name), "%s", json_string_value(jname));
+        document->latitude = json_number_value(jlatitude);
+        document->longitude = json_number_value(jlongitude);
+        json_decref(root);
+
+        char path[512];
+        snprintf(path, sizeof(path), "%s/%s.json", docsDir, document->name);
+        document->body = load_file(path, &document->size);
+        if(document->body == NULL)
+            continue;
+
+        // FNV-1a over the body is plenty for a recorded, never changing document
+        unsigned long long hash = 1469598103934665603ULL;
+        for(size_t i = 0; i < document->size; i++)
+            hash = (hash ^ (unsigned char)document->body[i]) * 1099511628211ULL;
+        snprintf(document->etag, sizeof(document->etag), "\"%016llx\"", hash);
+
+        document_count++;
+    }
+
+    tinydir_close(&dir);
+}
+
+static Document* nearest_document(double latitude, double longitude) {
+    Document* best = NULL;
+    double best_distance = 0;
+    for(int i = 0; i < document_count; i++) {
+        double dlat = documents[i].latitude - latitude;
+        double dlon = documents[i].longitude - longitude;
+        double distance = dlat * dlat + dlon * dlon;
+        if(best == NULL || distance < best_distance) {
+            best = &documents[i];
+            best_distance = distance;
+        }
+    }
+    return best;
+}
+
+// Reads a comma separated list of numbers for parameter name from the query string
+static int query_list(const char* query, const char* name, double* values, int max) {
+    char key[32];
+    snprintf(key, sizeof(key), "%s=", name);
+
+    const char* ptr = query;
+    while((ptr = strstr(ptr, key)) != NULL) {
+        if(ptr == query || ptr[-1] == '?' || ptr[-1] == '&')
+            break;
+        ptr += strlen(key);
+    }
+    if(ptr == NULL)
+        return 0;
+    ptr += strlen(key);
+
+    int count = 0;
+    while(count < max) {
+        char* end;
+        values[count] = strtod(ptr, &end);
+        if(end == ptr)
+            break;
+        count++;
+        if(*end != ',')
+            break;
+        ptr = end + 1;
+    }
+    return count;
+}
+
+#ifdef STANDIN_HTTP2
+// One request stream: what handle_request needs from its headers, then the response body
+typedef struct {
+    char path[4096];
+    char if_none_match[64];
+    char* body;
+    size_t size;
+    size_t sent;
+} H2Stream;
+
+static ssize_t h2_read_body(nghttp2_session* session, int32_t streamId, uint8_t* buffer, size_t length,
+                            uint32_t* flags, nghttp2_data_source* source, void* userData) {
+    (void)session; (void)streamId; (void)userData;
+    H2Stream* stream = (H2Stream*)source->ptr;
+    size_t piece = stream->size - stream->sent < length ? stream->size - stream->sent : length;
+    memcpy(buffer, stream->body + stream->sent, piece);
+    stream->sent += piece;
+    if(stream->sent == stream->size)
+        *flags |= NGHTTP2_DATA_FLAG_EOF;
+    return (ssize_t)piece;
+}
+
+#define H2_HEADER(name, value) { (uint8_t*)(name), (uint8_t*)(value), strlen(name), strlen(value), NGHTTP2_NV_FLAG_NONE }
+
+// send_response for HTTP/2: queues the response on the stream, nghttp2 writes it out
+static int h2_respond(Connection* conn, int status, const char* etag, const char* body, size_t size) {
+    H2Stream* stream = (H2Stream*)nghttp2_session_get_stream_user_data(conn->h2, conn->stream_id);
+    if(stream == NULL)
+        return -1;
+
+    if(size > 0) {
+        stream->body = malloc(size); // the caller's body may be gone before it is sent
+        if(stream->body == NULL)
+            return -1;
+        memcpy(stream->body, body, size);
+        stream->size = size;
+    }
+
+    char status_text[8];
+    char length_text[24];
+    snprintf(status_text, sizeof(status_text), "%d", status);
+    snprintf(length_text, sizeof(length_text), "%zu", size);
+    nghttp2_nv headers[] = {
+        H2_HEADER(":status", status_text),
+        H2_HEADER("content-type", "application/json"),
+        H2_HEADER("content-length", length_text),
+        H2_HEADER("etag", etag != NULL ? etag : "")
+    };
+    size_t header_count = etag != NULL ? 4 : 3;
+
+    nghttp2_data_provider provider;
+    provider.source.ptr = stream;
+    provider.read_callback = h2_read_body;
+    return nghttp2_submit_response(conn->h2, conn->stream_id, headers, header_count, size > 0 ? &provider : NULL) == 0 ? 0 : -1;
+}
+#endif
+
+static int send_response(Connection* conn, int status, const char* reason, const char* etag,
+                         const char* body, size_t size, int keepAlive, int drip) {
+#ifdef STANDIN_HTTP2
+    if(conn->h2 != NULL)
+        return h2_respond(conn, status, etag, body, size);
+#endif
+
+    char header[512];
+    int header_size = snprintf(header, sizeof(header),
+        "HTTP/1.1 %d %s\r\nContent-Type: application/json\r\nContent-Length: %zu\r\n%s%s%sConnection: %s\r\n\r\n",
+        status, reason, size, etag != NULL ? "ETag: " : "", etag != NULL ? etag : "", etag != NULL ? "\r\n" : "",
+        keepAlive ? "keep-alive" : "close");
+
+    if(conn_write(conn, header, header_size) < 0)
+        return -1;
+
+    if(!drip || drip_bytes <= 0)
+        return size > 0 && conn_write(conn, body, (int)size) < 0 ? -1 : 0;
+
+    for(size_t sent = 0; sent < size; sent += drip_bytes) {
+        size_t piece = size - sent < (size_t)drip_bytes ? size - sent : (size_t)drip_bytes;
+        if(conn_write(conn, body + sent, (int)piece) < 0)
+            return -1;
+        sleep_ms(drip_ms);
+    }
+    return 0;
+}
+
+// Sends a small error document; returns 0 to keep the connection, -1 to close it
+static int send_error(Connection* conn, int status, const char* reason, const char* message, int keepAlive) {
+    char body[256];
+    int size = snprintf(body, sizeof(body), "{\"error\":true,\"reason\":\"%s\"}", message);
+    return send_response(conn, status, reason, NULL, body, size, keepAlive, 0) == 0 && keepAlive ? 0 : -1;
+}
+
+// Returns 0 to keep the connection, -1 to close it
+static int handle_request(Connection* conn, char* request) {
+    int keep_alive = strcasestr(request, "\r\nConnection: close") == NULL;
+
+    char* line_end = strstr(request, "\r\n");
+    *line_end = '\0';
+
+    char* target = strchr(request, ' ');
+    if(strncmp(request, "GET ", 4) != 0 || target == NULL)
+        return send_error(conn, 405, "Method Not Allowed", "only GET is supported", 0);
+    target++;
+    char* target_end = strchr(target, ' ');
+    if(target_end != NULL)
+        *target_end = '\0';
+
+    sleep_ms(sample_latency(&conn->seed));
+
+    if(reset_rate > 0 && random_unit(&conn->seed) < reset_rate) {
+        struct linger linger = { 1, 0 }; // close() now sends RST instead of FIN
+        setsockopt(conn->fd, SOL_SOCKET, SO_LINGER, &linger, sizeof(linger));
+        return -1;
+    }
+
+    if(error_rate > 0 && random_unit(&conn->seed) < error_rate)
+        return send_error(conn, 503, "Service Unavailable", "injected fault", keep_alive);
+
+    if(strncmp(target, "/v1/forecast?", 13) != 0)
+        return send_error(conn, 404, "Not Found", "not found", keep_alive);
+
+    double latitudes[STANDIN_MAX_COORDINATES];
+    double longitudes[STANDIN_MAX_COORDINATES];
+    int count = query_list(target, "latitude", latitudes, STANDIN_MAX_COORDINATES);
+    if(count == 0 || query_list(target, "longitude", longitudes, STANDIN_MAX_COORDINATES) != count)
+        return send_error(conn, 400, "Bad Request", "latitude and longitude must have the same number of elements", keep_alive);
+
+    int drip = drip_rate > 0 && random_unit(&conn->seed) < drip_rate;
+
+    if(count == 1) {
+        Document* document = nearest_document(latitudes[0], longitudes[0]);
+        char* if_none_match = strcasestr(line_end + 2, "If-None-Match:");
+        if(if_none_match != NULL && strstr(if_none_match, document->etag) != NULL)
+            return send_response(conn, 304, "Not Modified", document->etag, "", 0, keep_alive, 0) == 0 && keep_alive ? 0 : -1;
+
+        return send_response(conn, 200, "OK", document->etag, document->body, document->size, keep_alive, drip) == 0 && keep_alive ? 0 : -1;
+    }
+
+    // Several locations: one JSON array with a document per coordinate, in request order
+    size_t size = 2;
+    Document* selected[STANDIN_MAX_COORDINATES];
+    for(int i = 0; i < count; i++) {
+        selected[i] = nearest_document(latitudes[i], longitudes[i]);
+        size += selected[i]->size + 1;
+    }
+
+    char* body = malloc(size + 1);
+    if(body == NULL)
+        return -1;
+
+    size_t used = 0;
+    body[used++] = '[';
+    for(int i = 0; i < count; i++) {
+        if(i > 0)
+            body[used++] = ',';
+        memcpy(body + used, selected[i]->body, selected[i]->size);
+        used += selected[i]->size;
+    }
+    body[used++] = ']';
+
+    int result = send_response(conn, 200, "OK", NULL, body, used, keep_alive, drip);
+    free(body);
+    return result == 0 && keep_alive ? 0 : -1;
+}
+
+#ifdef STANDIN_HTTP2
+static ssize_t h2_send(nghttp2_session* session, const uint8_t* data, size_t length, int flags, void* userData) {
+    (void)session; (void)flags;
+    return conn_write((Connection*)userData, (const char*)data, (int)length) < 0 ? NGHTTP2_ERR_CALLBACK_FAILURE : (ssize_t)length;
+}
+
+static int h2_begin_headers(nghttp2_session* session, const nghttp2_frame* frame, void* userData) {
+    (void)userData;
+    if(frame->hd.type != NGHTTP2_HEADERS || frame->headers.cat != NGHTTP2_HCAT_REQUEST)
+        return 0;
+
+    H2Stream* stream = calloc(1, sizeof(H2Stream));
+    if(stream == NULL)
+        return NGHTTP2_ERR_CALLBACK_FAILURE;
+    nghttp2_session_set_stream_user_data(session, frame->hd.stream_id, stream);
+    return 0;
+}
+
+static int h2_header(nghttp2_session* session, const nghttp2_frame* frame, const uint8_t* name, size_t nameLength,
+                     const uint8_t* value, size_t valueLength, uint8_t flags, void* userData) {
+    (void)flags; (void)userData;
+    H2Stream* stream = (H2Stream*)nghttp2_session_get_stream_user_data(session, frame->hd.stream_id);
+    if(stream == NULL || frame->hd.type != NGHTTP2_HEADERS)
+        return 0;
+
+    if(nameLength == 5 && memcmp(name, ":path", 5) == 0)
+        snprintf(stream->path, sizeof(stream->path), "%.*s", (int)valueLength, (const char*)value);
+    else if(nameLength == 13 && memcmp(name, "if-none-match", 13) == 0)
+        snprintf(stream->if_none_match, sizeof(stream->if_none_match), "%.*s", (int)valueLength, (const char*)value);
+    return 0;
+}
+
+// A complete request: rewritten as an HTTP/1.1 request head and answered by handle_request
+static int h2_frame_received(nghttp2_session* session, const nghttp2_frame* frame, void* userData) {
+    Connection* conn = (Connection*)userData;
+    if((frame->hd.type != NGHTTP2_HEADERS && frame->hd.type != NGHTTP2_DATA) || !(frame->hd.flags & NGHTTP2_FLAG_END_STREAM))
+        return 0;
+
+    H2Stream* stream = (H2Stream*)nghttp2_session_get_stream_user_data(session, frame->hd.stream_id);
+    if(stream == NULL)
+        return 0;
+
+    char request[4200];
+    snprintf(request, sizeof(request), "GET %s HTTP/2\r\n%s%s%s", stream->path,
+             stream->if_none_match[0] != '\0' ? "If-None-Match: " : "", stream->if_none_match,
+             stream->if_none_match[0] != '\0' ? "\r\n" : "");
+
+    conn->stream_id = frame->hd.stream_id;
+    return handle_request(conn, request) == 0 ? 0 : NGHTTP2_ERR_CALLBACK_FAILURE; // -1 drops the connection
+}
+
+static int h2_stream_closed(nghttp2_session* session, int32_t streamId, uint32_t errorCode, void* userData) {
+    (void)errorCode; (void)userData;
+    H2Stream* stream = (H2Stream*)nghttp2_session_get_stream_user_data(session, streamId);
+    if(stream != NULL) {
+        free(stream->body);
+        free(stream);
+        nghttp2_session_set_stream_user_data(session, streamId, NULL);
+    }
+    return 0;
+}
+
+static void serve_http2(Connection* conn) {
+    nghttp2_session_callbacks* callbacks;
+    if(nghttp2_session_callbacks_new(&callbacks) != 0)
+        return;
+    nghttp2_session_callbacks_set_send_callback(callbacks, h2_send);
+    nghttp2_session_callbacks_set_on_begin_headers_callback(callbacks, h2_begin_headers);
+    nghttp2_session_callbacks_set_on_header_callback(callbacks, h2_header);
+    nghttp2_session_callbacks_set_on_frame_recv_callback(callbacks, h2_frame_received);
+    nghttp2_session_callbacks_set_on_stream_close_callback(callbacks, h2_stream_closed);
+
+    int result = nghttp2_session_server_new(&conn->h2, callbacks, conn);
+    nghttp2_session_callbacks_del(callbacks);
+    if(result != 0) {
+        conn->h2 = NULL;
+        return;
+    }
+
+    nghttp2_settings_entry settings[] = { { NGHTTP2_SETTINGS_MAX_CONCURRENT_STREAMS, 100 } };
+    nghttp2_submit_settings(conn->h2, NGHTTP2_FLAG_NONE, settings, 1);
+
+    char buffer[16384];
+    while(nghttp2_session_send(conn->h2) == 0 &&
+          (nghttp2_session_want_read(conn->h2) || nghttp2_session_want_write(conn->h2))) {
+        int n = conn_read(conn, buffer, sizeof(buffer));
+        if(n <= 0 || nghttp2_session_mem_recv(conn->h2, (const uint8_t*)buffer, n) < 0)
+            break;
+    }
+
+    nghttp2_session_del(conn->h2);
+    conn->h2 = NULL;
+}
+
+static int select_protocol(SSL* ssl, const unsigned char** out, unsigned char* outLength,
+                           const unsigned char* in, unsigned int inLength, void* arg) {
+    (void)ssl; (void)arg;
+    static const unsigned char protocols[] = "\x02h2\x08http/1.1";
+    if(SSL_select_next_proto((unsigned char**)out, outLength, protocols, sizeof(protocols) - 1, in, inLength) != OPENSSL_NPN_NEGOTIATED)
+        return SSL_TLSEXT_ERR_NOACK; // no overlap: plain HTTP/1.1
+    return SSL_TLSEXT_ERR_OK;
+}
+#endif
+
+static void* connection_thread(void* arg) {
+    Connection conn = *(Connection*)arg;
+    free(arg);
+
+    if(conn.ssl != NULL && SSL_accept(conn.ssl) <= 0) {
+        SSL_free(conn.ssl);
+        close(conn.fd);
+        return NULL;
+    }
+
+#ifdef STANDIN_HTTP2
+    const unsigned char* protocol = NULL;
+    unsigned int protocol_length = 0;
+    if(conn.ssl != NULL)
+        SSL_get0_alpn_selected(conn.ssl, &protocol, &protocol_length);
+    if(protocol_length == 2 && memcmp(protocol, "h2", 2) == 0) {
+        serve_http2(&conn);
+        SSL_shutdown(conn.ssl);
+        SSL_free(conn.ssl);
+        close(conn.fd);
+        return NULL;
+    }
+#endif
+
+    char request[8192];
+    int used = 0;
+    while(1) {
+        int n = conn_read(&conn, request + used, sizeof(request) - 1 - used);
+        if(n <= 0)
+            break;
+        used += n;
+        request[used] = '\0';
+
+        char* end;
+        int keep = 1;
+        while(keep && (end = strstr(request, "\r\n\r\n")) != NULL) {
+            end[2] = '\0'; // keep the last header line terminated with \r\n for searching
+            keep = handle_request(&conn, request) == 0;
+
+            // Shift any pipelined bytes after this request to the start of the buffer
+            int consumed = (int)(end + 4 - request);
+            memmove(request, request + consumed, used - consumed + 1);
+            used -= consumed;
+        }
+
+        if(!keep || used >= (int)sizeof(request) - 1)
+            break; // closed on purpose, or request header too large
+    }
+
+    if(conn.ssl != NULL) {
+        SSL_shutdown(conn.ssl);
+        SSL_free(conn.ssl);
+    }
+    close(conn.fd);
+    return NULL;
+}
+
+int main(int argc, char** argv) {
+    int port = 8443;
+    unsigned int seed = (unsigned int)time(NULL);
+    const char* docs_dir = "cache";
+    const char* cities_dir = "cities";
+    const char* cert_path = NULL;
+    const char* key_path = NULL;
+
+    for(int i = 1; i + 1 < argc; i += 2) {
+        if(strcmp(argv[i], "-p") == 0)
+            port = atoi(argv[i + 1]);
+        else if(strcmp(argv[i], "-docs") == 0)
+            docs_dir = argv[i + 1];
+        else if(strcmp(argv[i], "-cities") == 0)
+            cities_dir = argv[i + 1];
+        else if(strcmp(argv[i], "-cert") == 0)
+            cert_path = argv[i + 1];
+        else if(strcmp(argv[i], "-key") == 0)
+            key_path = argv[i + 1];
+        else if(strcmp(argv[i], "-seed") == 0)
+            seed = (unsigned int)strtoul(argv[i + 1], NULL, 10);
+        else if(strcmp(argv[i], "-error-rate") == 0)
+            error_rate = atof(argv[i + 1]);
+        else if(strcmp(argv[i], "-reset-rate") == 0)
+            reset_rate = atof(argv[i + 1]);
+        else if(strcmp(argv[i], "-drip-rate") == 0)
+            drip_rate = atof(argv[i + 1]);
+        else if(strcmp(argv[i], "-drip") == 0) {
+            if(sscanf(argv[i + 1], "%d:%d", &drip_bytes, &drip_ms) != 2) {
+                fprintf(stderr, "Invalid -drip, expected BYTES:MS\n");
+                return -1;
+            }
+            if(drip_rate == 0)
+                drip_rate = 1;
+        } else if(strcmp(argv[i], "-http2") == 0) {
+            http2 = atoi(argv[i + 1]) != 0;
+        } else if(strcmp(argv[i], "-latency") == 0) {
+            if(parse_latency(argv[i + 1]) != 0) {
+                fprintf(stderr, "Invalid -latency: %s\n", argv[i + 1]);
+                return -1;
+            }
+        } else {
+            fprintf(stderr, "Unknown option: %s\n", argv[i]);
+            return -1;
+        }
+    }
+
+    load_documents(docs_dir, cities_dir);
+    if(document_count == 0) {
+        fprintf(stderr, "No recorded documents found in '%s' for the cities in '%s'\n", docs_dir, cities_dir);
+        return -1;
+    }
+
+    if(cert_path != NULL && key_path != NULL) {
+        ssl_ctx = SSL_CTX_new(TLS_server_method());
+        if(ssl_ctx == NULL ||
+           SSL_CTX_use_certificate_chain_file(ssl_ctx, cert_path) != 1 ||
+           SSL_CTX_use_PrivateKey_file(ssl_ctx, key_path, SSL_FILETYPE_PEM) != 1) {
+            ERR_print_errors_fp(stderr);
+            return -1;
+        }
+    }
+
+    if(http2) {
+#ifdef STANDIN_HTTP2
+        if(ssl_ctx == NULL) {
+            fprintf(stderr, "-http2 needs -cert and -key, h2 is only offered over TLS\n");
+            return -1;
+        }
+        SSL_CTX_set_alpn_select_cb(ssl_ctx, select_protocol, NULL);
+#else
+        fprintf(stderr, "-http2 needs a build with STANDIN_HTTP2 (make bench HTTP2=1)\n");
+        return -1;
+#endif
+    }
+
+    signal(SIGPIPE, SIG_IGN);
+
+    int server = socket(AF_INET, SOCK_STREAM, 0);
+    int yes = 1;
+    setsockopt(server, SOL_SOCKET, SO_REUSEADDR, &yes, sizeof(yes));
+
+    struct sockaddr_in addr;
+    memset(&addr, 0, sizeof(addr));
+    addr.sin_family = AF_INET;
+    addr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+    addr.sin_port = htons(port);
+
+    if(bind(server, (struct sockaddr*)&addr, sizeof(addr)) != 0 || listen(server, 1024) != 0) {
+        perror("bind/listen");
+        return -1;
+    }
+
+    printf("Stand-in serving %d documents on %s://localhost:%d%s\n", document_count, ssl_ctx != NULL ? "https" : "http", port,
+           http2 ? " (h2 and http/1.1)" : "");
+    fflush(stdout);
+
+    while(1) {
+        int fd = accept(server, NULL, NULL);
+        if(fd < 0)
+            continue;
+        setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &yes, sizeof(yes));
+
+        Connection* conn = malloc(sizeof(Connection));
+        if(conn == NULL) {
+            close(fd);
+            continue;
+        }
+        memset(conn, 0, sizeof(Connection));
+        conn->fd = fd;
+        conn->ssl = NULL;
+        conn->seed = seed++;
+        if(ssl_ctx != NULL) {
+            conn->ssl = SSL_new(ssl_ctx);
+            SSL_set_fd(conn->ssl, fd);
+        }
+
+        pthread_t thread;
+        if(pthread_create(&thread, NULL, connection_thread, conn) != 0) {
+            if(conn->ssl != NULL)
+                SSL_free(conn->ssl);
+            close(fd);
+            free(conn);
+            continue;
+        }
+        pthread_detach(thread);
+    }
+
+    return 0;
+}